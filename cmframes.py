@@ -14,75 +14,64 @@ x - exit
 h - help
 """
 
-from zipfile import ZipFile
+import libcm
 
 filename = input("Enter file name for analysis: ")
 
-with ZipFile(filename, "r") as ark:
-  topFrame = len(ark.namelist()) - 1
-  frame = 0
-  router = 0
-  cell = 0
-  print("File loaded successfully. Contains ", len(ark.namelist()), " frames")
-  while True:
-    inp = input("[f: "+str(frame)+" r: "+str(router)+" c: "+str(cell)+"]$ ")
-    if inp[0] == "r" and int(inp[1:]) < 4096:
-      router = int(inp[1:])
-    elif inp[0] == "c" and int(inp[1:]) < 16:
-      cell = int(inp[1:])
-    elif inp == "sc":
-      #Each cell occupies 514 bytes
-      with ark.open(str(frame), "r") as f:
-        cellData = f.read()[8372 * router + cell*514: 8372 * router + (cell+1)*514]
-      print("Flags: ", int(cellData[1]) * 256 + int(cellData[0]))
-      print("Memory: ", list(int(cellData[i+2]) for i in range(512)))
-    elif inp == "sr":
-      with ark.open(str(frame), "r") as f:
-        routerData = f.read()[8372 * router + 16*514: 8372 * (router+1)]
-      #Messages are 9 bytes - a 4 byte address, a 4 byte message, and a parity bit byte. There's also
-      #the 16 byte listening array at the FRONT of the router data
-      for i in range(7):
-        print("Message ", i, ":")
-        print(" - Address: ", format(int(routerData[12*i + 1]) * 256 + int(routerData[12*i]), '#018b'))
-        print(" - Message: ", list(int(routerData[12*i + 4 + j]) for j in range (4)))
-        print(" - Parity: ", int(routerData[12*i + 8]))
-
-      for i in range(4):
-        print("Partial Message ", i, ":")
-        print(" - Address: ", format(int(routerData[12*i + 101]) * 256 + int(routerData[12*i + 100]), '#018b'))
-        print(" - Message: ", list(int(routerData[12*i + 104 + j]) for j in range (4)))
-        print(" - Parity: ", int(routerData[12*i + 108]))
-        print(" - Listener: ", int(routerData[84 + 4*i]))
-    elif inp[0] == "d":
-      if inp[1:] != "": av = int(inp[1:])
-      else: av = 1
-      frame = min(frame+av, topFrame)
-    elif inp[0] == "a":
-      if inp[1:] != "": av = int(inp[1:])
-      else: av = 1
-      frame = max(frame-av, 0);
-    elif inp[0] == "x":
-      break
-    elif inp[0] == "h":
-      print(commands)
-    elif inp[0] == "i":
-      print("Instruction:")
-      with ark.open(str(frame), "r") as f:
-        insData = f.read()[34291712 : 34291720]
-      ins64 = 0
-      for i in range(8):
-        ins64 = ins64 << 8
-        ins64 = ins64 | int(insData[7-i])
-      print(" - addrA: ", (ins64 >> 43) & ((1 << 12) - 1))
-      print(" - addrB: ", (ins64 >> 31) & ((1 << 12) - 1))
-      print(" - flagR: ", (ins64 >> 27) & ((1 <<  4) - 1))
-      print(" - flagW: ", (ins64 >> 23) & ((1 <<  4) - 1))
-      print(" - flagC: ", (ins64 >> 19) & ((1 <<  4) - 1))
-      print(" - sense: ", (ins64 >> 18) & ( 1           ))
-      print(" - mTrut: ", (ins64 >> 10) & ((1 <<  8) - 1))
-      print(" - fTrut: ", (ins64 >>  2) & ((1 <<  8) - 1))
-      print(" - newsD: ", (ins64      ) & ((1 <<  2) - 1))
-    else:
-      print("Unknown command")
-      print(commands)
+dump = libcm.Dump(filename)
+topFrame = len(dump) - 1
+frame = 0
+router = 0
+cell = 0
+print("File loaded successfully. Contains ", len(dump), " frames")
+while True:
+  inp = input("[f: "+str(frame)+" r: "+str(router)+" c: "+str(cell)+"]$ ")
+  if inp[0] == "r" and int(inp[1:]) < (1 << dump.dimensions):
+    router = int(inp[1:])
+  elif inp[0] == "c" and int(inp[1:]) < (1 << libcm.PROCESSORS):
+    cell = int(inp[1:])
+  elif inp == "sc":
+    cellData = dump.frame(frame)["chips"][router]["cells"][cell]
+    print("Flags: ", int(cellData["flags"]))
+    print("Memory: ", cellData["memory"].tolist())
+  elif inp == "sr":
+    routerData = dump.frame(frame)["chips"][router]
+    for i in range(libcm.BUFSIZE):
+      print("Message ", i, ":")
+      print(" - Address: ", format(int(routerData["buffer"][i]["address"]) & 0xFFFF, '#018b'))
+      print(" - Message: ", routerData["buffer"][i]["message"].tolist())
+      print(" - Parity: ", int(routerData["buffer"][i]["parity"]))
 
+    for i in range(4):
+      print("Partial Message ", i, ":")
+      print(" - Address: ", format(int(routerData["partials"][i]["address"]) & 0xFFFF, '#018b'))
+      print(" - Message: ", routerData["partials"][i]["message"].tolist())
+      print(" - Parity: ", int(routerData["partials"][i]["parity"]))
+      print(" - Listener: ", int(routerData["listening"][i]))
+  elif inp[0] == "d":
+    if inp[1:] != "": av = int(inp[1:])
+    else: av = 1
+    frame = min(frame+av, topFrame)
+  elif inp[0] == "a":
+    if inp[1:] != "": av = int(inp[1:])
+    else: av = 1
+    frame = max(frame-av, 0);
+  elif inp[0] == "x":
+    break
+  elif inp[0] == "h":
+    print(commands)
+  elif inp[0] == "i":
+    print("Instruction:")
+    ins = libcm.decode(int(dump.frame(frame)["ins"]), dump.cell_bits)
+    print(" - addrA: ", ins["addrA"])
+    print(" - addrB: ", ins["addrB"])
+    print(" - flagR: ", ins["flagR"])
+    print(" - flagW: ", ins["flagW"])
+    print(" - flagC: ", ins["flagC"])
+    print(" - sense: ", ins["sense"])
+    print(" - mTrut: ", ins["memTruth"])
+    print(" - fTrut: ", ins["flagTruth"])
+    print(" - newsD: ", ins["newsDir"])
+  else:
+    print("Unknown command")
+    print(commands)
@@ -0,0 +1,267 @@
+"""Python bindings for libcm, for poking at a Machine and its dumps with NumPy.
+
+The library has to be built as a shared object first, with the same settings as anything else it'll be
+used with, e.g.
+
+  gcc -O2 -shared -fPIC -Isrc -o libcmsim.so $(ls src/*.c | grep -v cm_dump.c) -lpthread
+
+Machine wraps a live cm. Its cell memory is handed out as NumPy arrays laid straight over the simulator's
+own memory, so nothing is copied and vectorised queries run against the real thing. Flags and router
+state live in separate structures inside the simulator, so they come from a snapshot, which is a dump
+frame written into a NumPy array in one go.
+
+Dump opens the zip archives written by cm_dump and cm_capture. Frames are structured arrays in the layout
+described by frame_dtype. A frame stored without compression (zip -0) is mapped straight from the file;
+compressed ones are inflated once and the array laid over the result.
+"""
+
+import ctypes
+import os
+import re
+import zipfile
+
+import numpy as np
+
+PROCESSORS = 4
+CELL_PAGES = 16
+BUFSIZE = 7
+
+# A Message exactly as the C struct is laid out: a 4 byte address, the 4 byte message, the parity byte
+# and 3 bytes of padding
+MESSAGE = np.dtype([("address", "=u4"), ("message", "u1", (4,)), ("parity", "u1"), ("pad", "V3")])
+
+# A cm_frame from a capture ring, see connection_machine.h
+RING = np.dtype([("ins", "=u8"), ("cycle", "=u4"), ("petitCounter", "=u4"), ("referred", "=u4"),
+                 ("parityFailed", "=u4"), ("fired", "=u4"), ("globalPin", "u1")], align=True)
+
+
+def frame_dtype(dimensions=12, cell_bits=4096):
+  """The layout of a dump frame, as written by cm_dump and cm_snapshot"""
+  cell = np.dtype([("flags", "=u2"), ("memory", "u1", (cell_bits // 8,))])
+  chip = np.dtype([("cells", cell, (1 << PROCESSORS,)), ("buffer", MESSAGE, (BUFSIZE,)),
+                   ("listening", "=u4", (4,)), ("partials", MESSAGE, (4,))])
+  return np.dtype([("chips", chip, (1 << dimensions,)), ("ins", "=u8")])
+
+
+def frame_geometry(size):
+  """Works out (dimensions, cell_bits) from the size of a frame. Every size has just one answer."""
+  for cell_bits in (4096, 8192, 16384, 32768, 65536):
+    for dimensions in range(1, 21):
+      if frame_dtype(dimensions, cell_bits).itemsize == size:
+        return dimensions, cell_bits
+  raise ValueError("%d bytes isn't the size of any frame" % size)
+
+
+def addr_bits(cell_bits):
+  """How wide addresses are in packed instructions"""
+  return max(12, cell_bits.bit_length() - 1)
+
+
+def decode(ins, cell_bits=4096):
+  """Unpacks an instruction packed by cm_pack. Works on NumPy arrays of them too."""
+  bits = addr_bits(cell_bits)
+  return {
+    "addrA": (ins >> (31 + bits)) & ((1 << bits) - 1),
+    "addrB": (ins >> 31) & ((1 << bits) - 1),
+    "flagR": (ins >> 27) & 0xF,
+    "flagW": (ins >> 23) & 0xF,
+    "flagC": (ins >> 19) & 0xF,
+    "sense": (ins >> 18) & 1,
+    "memTruth": (ins >> 10) & 0xFF,
+    "flagTruth": (ins >> 2) & 0xFF,
+    "newsDir": ins & 3,
+  }
+
+
+def cells(frame):
+  """Every cell in a frame as a flat array of (flags, memory) records, cell n at index n. No copying."""
+  return frame["chips"]["cells"].reshape(-1)
+
+
+def _field(memory, offset, length):
+  """The length bits starting offset bits into each row of memory, as uint64s"""
+  bits = np.unpackbits(memory, axis=1)[:, offset:offset + length].astype(np.uint64)
+  weights = np.uint64(1) << np.arange(length - 1, -1, -1, dtype=np.uint64)
+  return bits @ weights
+
+
+def read_field(frame, addr, length):
+  """The length bit field at addr of every cell in a frame, most significant bit first as with
+  cm_read_field. Returns uint64s, cell n at index n."""
+  return _field(cells(frame)["memory"][:, addr >> 3:((addr + length - 1) >> 3) + 1], addr & 7, length)
+
+
+class Dump:
+  """A dump or capture archive. Frames are named after the cycle they were taken on."""
+
+  def __init__(self, fileName):
+    self.fileName = fileName
+    self.zip = zipfile.ZipFile(fileName, "r")
+    self.frames = sorted((i for i in self.zip.infolist() if i.filename.isdigit()),
+                         key=lambda i: int(i.filename))
+    self.rings = sorted((i for i in self.zip.infolist() if re.fullmatch(r"ring\d+", i.filename)),
+                        key=lambda i: int(i.filename[4:]))
+    if self.frames:
+      self.dimensions, self.cell_bits = frame_geometry(self.frames[0].file_size)
+      self.dtype = frame_dtype(self.dimensions, self.cell_bits)
+
+  def __len__(self):
+    return len(self.frames)
+
+  def _data(self, info):
+    """Where the entry's data starts in the archive, for entries stored as they are"""
+    with open(self.fileName, "rb") as f:
+      f.seek(info.header_offset + 26)
+      header = f.read(4)
+    nameLength, extraLength = int.from_bytes(header[:2], "little"), int.from_bytes(header[2:], "little")
+    return info.header_offset + 30 + nameLength + extraLength
+
+  def _array(self, info, dtype, shape):
+    if info.compress_type == zipfile.ZIP_STORED:
+      return np.memmap(self.fileName, dtype=dtype, mode="r", offset=self._data(info), shape=shape)
+    return np.frombuffer(self.zip.read(info), dtype=dtype, count=int(np.prod(shape))).reshape(shape)
+
+  def frame(self, index):
+    """Frame number index in cycle order, as a structured array of frame_dtype"""
+    return self._array(self.frames[index], self.dtype, (1,))[0]
+
+  def cycle(self, index):
+    return int(self.frames[index].filename)
+
+  def ring(self, index):
+    """The cm_frame records saved with a capture, oldest first"""
+    info = self.rings[index]
+    return self._array(info, RING, (info.file_size // RING.itemsize,))
+
+
+def open_frame(fileName):
+  """A frame in a file of its own, such as one unzipped from a dump, mapped straight from the file"""
+  dimensions, cell_bits = frame_geometry(os.path.getsize(fileName))
+  return np.memmap(fileName, dtype=frame_dtype(dimensions, cell_bits), mode="r", shape=(1,))[0]
+
+
+def _library(path):
+  lib = ctypes.CDLL(path)
+  cm = ctypes.c_void_p
+  u8, u16, u32, u64 = ctypes.c_uint8, ctypes.c_uint16, ctypes.c_uint32, ctypes.c_uint64
+  signatures = {
+    "cm_build": ([], cm),
+    "cm_build_file": ([ctypes.c_char_p], cm),
+    "cm_del": ([cm], None),
+    "cm_exe": ([cm, u16, u16, u8, u8, u8, u8, u8, u8, u8], None),
+    "cm_exe_packed": ([cm, u64], None),
+    "cm_pack": ([u16, u16, u8, u8, u8, u8, u8, u8, u8], u64),
+    "cm_submit_batch": ([cm, ctypes.c_void_p, u32], None),
+    "cm_fence": ([cm], None),
+    "cm_write_field": ([cm, u32, u16, u8, u64], None),
+    "cm_read_field": ([cm, u32, u16, u8], u64),
+    "cm_write_flag": ([cm, u32, u8, u8], None),
+    "cm_read_flag": ([cm, u32, u8], u8),
+    "cm_geometry": ([ctypes.POINTER(u32), ctypes.POINTER(u32), ctypes.POINTER(u64)], None),
+    "cm_memory": ([cm], ctypes.c_void_p),
+    "cm_mark_live": ([cm, u16], ctypes.c_int),
+    "cm_snapshot": ([cm, u64, ctypes.c_void_p], None),
+    "petit_sync": ([cm], None),
+    "network_empty": ([cm], ctypes.c_int),
+  }
+  for name, (args, result) in signatures.items():
+    f = getattr(lib, name)
+    f.argtypes = args
+    f.restype = result
+  return lib
+
+
+class Machine:
+  """A live Machine. Modes and anything else not wrapped here can be reached through lib and ptr."""
+
+  def __init__(self, library=None, fileName=None):
+    self.lib = _library(library or os.environ.get("LIBCM", "./libcmsim.so"))
+    if fileName is None:
+      self.ptr = self.lib.cm_build()
+    else:
+      self.ptr = self.lib.cm_build_file(fileName.encode())
+    if not self.ptr:
+      raise MemoryError("couldn't build a Machine")
+
+    dimensions, cell_bits, frame_bytes = ctypes.c_uint32(), ctypes.c_uint32(), ctypes.c_uint64()
+    self.lib.cm_geometry(ctypes.byref(dimensions), ctypes.byref(cell_bits), ctypes.byref(frame_bytes))
+    self.dimensions, self.cell_bits = dimensions.value, cell_bits.value
+    self.cells = 1 << (self.dimensions + PROCESSORS)
+    self.page_bytes = self.cell_bits // 8 // CELL_PAGES
+    self.dtype = frame_dtype(self.dimensions, self.cell_bits)
+    if self.dtype.itemsize != frame_bytes.value:
+      raise RuntimeError("frame layout doesn't match the library")
+
+  def close(self):
+    if self.ptr:
+      self.lib.cm_del(self.ptr)
+      self.ptr = None
+
+  def __enter__(self):
+    return self
+
+  def __exit__(self, *exc):
+    self.close()
+
+  def _region(self):
+    size = CELL_PAGES * self.cells * self.page_bytes
+    base = self.lib.cm_memory(self.ptr)
+    return np.ctypeslib.as_array((ctypes.c_uint8 * size).from_address(base))
+
+  def memory(self):
+    """Every cell's memory as a read only cells x pages x page bytes array, laid over the simulator's
+    memory. Memory is stored a page at a time for every cell, which is why the pages get an axis of
+    their own. It shows the memory as it is whenever it's read, so read it after fencing."""
+    return np.lib.stride_tricks.as_strided(
+      self._region(), shape=(self.cells, CELL_PAGES, self.page_bytes),
+      strides=(self.page_bytes, self.cells * self.page_bytes, 1), writeable=False)
+
+  def plane(self, page, writable=False):
+    """Page page of every cell, cells x page bytes, laid over the simulator's memory. Asking for it
+    writable marks the page as written in every cell, so the simulator sees what's put there. Writes
+    through it aren't recorded, so it can't be writable while a trace or history is being kept."""
+    if writable and self.lib.cm_mark_live(self.ptr, page):
+      raise RuntimeError("can't write memory directly while recording, or no such page")
+    region = self._region()
+    view = region[page * self.cells * self.page_bytes:(page + 1) * self.cells * self.page_bytes]
+    view = view.reshape(self.cells, self.page_bytes)
+    view.flags.writeable = writable
+    return view
+
+  def read_field(self, addr, length):
+    """The field at addr in every cell, straight from memory. Only the bytes holding it are copied."""
+    memory = self.memory()
+    first, last = addr >> 3, (addr + length - 1) >> 3
+    pieces = []
+    for p in range(first // self.page_bytes, last // self.page_bytes + 1):
+      start = p * self.page_bytes
+      pieces.append(memory[:, p, max(first - start, 0):min(last + 1 - start, self.page_bytes)])
+    return _field(np.concatenate(pieces, axis=1), addr & 7, length)
+
+  def snapshot(self, ins=0):
+    """The whole Machine as a frame, flags and router buffers included, written by cm_snapshot"""
+    frame = np.zeros(1, dtype=self.dtype)
+    self.lib.cm_fence(self.ptr)
+    self.lib.cm_snapshot(self.ptr, ins, frame.ctypes.data)
+    return frame[0]
+
+  def exe(self, addrA, addrB, flagR, flagW, flagC, sense, memTruth, flagTruth, newsDir):
+    self.lib.cm_exe(self.ptr, addrA, addrB, flagR, flagW, flagC, sense, memTruth, flagTruth, newsDir)
+
+  def pack(self, addrA, addrB, flagR, flagW, flagC, sense, memTruth, flagTruth, newsDir):
+    return self.lib.cm_pack(addrA, addrB, flagR, flagW, flagC, sense, memTruth, flagTruth, newsDir)
+
+  def run(self, ins):
+    """Runs an array of packed instructions through cm_submit_batch, then waits for them to finish"""
+    ins = np.ascontiguousarray(ins, dtype=np.uint64)
+    self.lib.cm_submit_batch(self.ptr, ins.ctypes.data, len(ins))
+    self.lib.cm_fence(self.ptr)
+
+  def write_field(self, cell, addr, length, value):
+    self.lib.cm_write_field(self.ptr, cell, addr, length, value)
+
+  def write_flag(self, cell, flag, value):
+    self.lib.cm_write_flag(self.ptr, cell, flag, value)
+
+  def read_flag(self, cell, flag):
+    return self.lib.cm_read_flag(self.ptr, cell, flag)
@@ -22,10 +22,10 @@ uint8_t cell_exe(Cell *c, uint16_t addrA, uint16_t addrB, uint8_t flagR, uint8_t
    // printf("%d\n", ((c->flags >> (15-flagC)) & 1));
    if (((c->flags >> (15-flagC)) & 1) != sense) return 0;
 
-   /* Step 2: extract the 2 bits from memory. Shift right 3 to find the index, then
-    * take the difference to find the actual word offset */
-   uint8_t datA = ((c->memory)[addrA >> 3] >> (7-(addrA & 7))) & 1;
-   uint8_t datB = ((c->memory)[addrB >> 3] >> (7-(addrB & 7))) & 1;
+   /* Step 2: extract the 2 bits from memory. Pages that have never been written are all zeros, so
+    * don't even need looking at */
+   uint8_t datA = cell_read(c, addrA);
+   uint8_t datB = cell_read(c, addrB);
    // printf("%d\n", datB);
    uint8_t datF = (c->flags >> (15-flagR)) & 1;
 
@@ -41,23 +41,8 @@ uint8_t cell_exe(Cell *c, uint16_t addrA, uint16_t addrB, uint8_t flagR, uint8_t
    uint8_t memV = (memTruth >> (7-index)) & 1;
    uint8_t flagV = (flagTruth >> (7-index)) & 1;
 
-   /* Finally, write back. This is a bit of a pain as we need to set a bit in a larger byte!
-    * The best way to do this seems to be to shift a 1 to the correct position; if writing 1,
-    * simply or it in, if writing 0, not and then and it in.
-    */
-
-   /* Do this with the memory first */
-   uint8_t memMask = 1 << (7 - (addrA & 7));
-   uint8_t memByte = (c->memory)[addrA >> 3];
-   if (memV) /* Writing a 1 */
-   {
-      memByte |= memMask;
-   }
-   else /* Writing a 0 */
-   {
-      memByte &= ~memMask;
-   }
-   (c->memory)[addrA >> 3] = memByte;
+   /* Finally, write back, with the memory first */
+   cell_write(c, addrA, memV);
 
    /* Similar thing with the flags. However, we first must check it's a writeable flag! */
    if (!(flagW == 0 || flagW == 3 || flagW == 4 || flagW == 6 || flagW == 7))
@@ -85,3 +70,83 @@ uint8_t cell_exe(Cell *c, uint16_t addrA, uint16_t addrB, uint8_t flagR, uint8_t
  * from above. Additional functions may be defined for easily writing to cells for initialisation
  * and reading results from them later on.
  */
+
+/* Memory access goes through pages. The page holding a bit is addr / PAGE_BITS, and within it the bits
+ * run most significant first through each byte. A page only becomes live when a 1 is written into it;
+ * writing zeros into a page that isn't live leaves it as it is, all zeros.
+ */
+uint8_t cell_read(Cell *c, uint16_t addr)
+{
+   uint32_t page = addr / PAGE_BITS;
+   if (!((c->live >> page) & 1)) return 0;
+   uint8_t byte = c->home[page * PLANE_BYTES + ((addr % PAGE_BITS) >> 3)];
+   return (byte >> (7 - (addr & 7))) & 1;
+}
+
+void cell_write(Cell *c, uint16_t addr, uint8_t value)
+{
+   /* This is a bit of a pain as we need to set a bit in a larger byte! The best way to do this seems to
+    * be to shift a 1 to the correct position; if writing 1, simply or it in, if writing 0, not and then
+    * and it in.
+    */
+   uint32_t page = addr / PAGE_BITS;
+   if (!((c->live >> page) & 1))
+   {
+      if (!value) return;
+      c->live |= 1 << page;
+   }
+   uint8_t *byte = &(c->home[page * PLANE_BYTES + ((addr % PAGE_BITS) >> 3)]);
+   if (value) *byte |= 1 << (7 - (addr & 7));
+   else *byte &= ~(1 << (7 - (addr & 7)));
+}
+
+/* A whole byte at once, byte 0 holding bits 0 to 7 */
+uint8_t cell_byte(Cell *c, uint16_t byte)
+{
+   uint32_t page = byte / PAGE_BYTES;
+   if (!((c->live >> page) & 1)) return 0;
+   return c->home[page * PLANE_BYTES + (byte % PAGE_BYTES)];
+}
+
+/* Fields are read and written with addr as the most significant bit, the same order messages are sent
+ * in. Both work a byte at a time rather than a bit at a time, and take up to 64 bits.
+ */
+uint64_t cell_read_field(Cell *c, uint16_t addr, uint8_t len)
+{
+   uint64_t v = 0;
+   uint32_t a = addr, end = addr + len;
+   while (a < end)
+   {
+      uint32_t off = a & 7;
+      uint32_t take = 8 - off;
+      if (take > end - a) take = end - a;
+      uint8_t byte = cell_byte(c, a >> 3);
+      v = (v << take) | ((byte >> (8 - off - take)) & ((1 << take) - 1));
+      a += take;
+   }
+   return v;
+}
+
+void cell_write_field(Cell *c, uint16_t addr, uint8_t len, uint64_t value)
+{
+   uint32_t a = addr + len;
+   while (a > addr)
+   {
+      /* Walk backwards from the least significant bit so the value can just be shifted down */
+      uint32_t off = (a - 1) & 7;
+      uint32_t take = off + 1;
+      if (take > a - addr) take = a - addr;
+      uint8_t shift = 7 - off;
+      uint8_t mask = ((1 << take) - 1) << shift;
+      uint32_t page = ((a - 1) >> 3) / PAGE_BYTES;
+      uint8_t bits = (value << shift) & mask;
+      if (((c->live >> page) & 1) || bits)
+      {
+         c->live |= 1 << page;
+         uint8_t *byte = &(c->home[page * PLANE_BYTES + (((a - 1) >> 3) % PAGE_BYTES)]);
+         *byte = (*byte & ~mask) | bits;
+      }
+      value >>= take;
+      a -= take;
+   }
+}
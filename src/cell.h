@@ -2,16 +2,59 @@
 #define CM_CELL_H_
 
 #include <stdint.h>
+#include "router.h"
+
+/* Cell memory is kept in pages, which only take up space once something other than zeros is written to
+ * them. The memory of every cell in the machine lives in one region, laid out page by page: all the
+ * cells' page 0s, then all their page 1s and so on. An instruction addresses the same bits in every cell,
+ * so it only touches one contiguous stretch of the region.
+ */
+#ifndef CELL_BITS /* Can be set when building, to a power of 2 from 4096 to 65536 */
+#define CELL_BITS 4096 /* 4kbit memory */
+#endif
+/* Addresses are 16 bits, and every page has to be a whole number of bytes */
+#if CELL_BITS < 4096 || CELL_BITS > 65536 || (CELL_BITS & (CELL_BITS - 1))
+#error "CELL_BITS has to be a power of 2 from 4096 to 65536"
+#endif
+#define CELL_BYTES (CELL_BITS >> 3)
+#define CELL_PAGES 16 /* One for each bit of live */
+#define PAGE_BYTES (CELL_BYTES / CELL_PAGES)
+#define PAGE_BITS (PAGE_BYTES << 3)
+#define PLANE_BYTES ((1 << (DIMENSIONS + PROCESSORS)) * PAGE_BYTES) /* Distance between a cell's pages */
+
+/* Bits needed for an address, which is how wide they are in packed instructions */
+#if CELL_BITS <= 4096
+#define ADDR_BITS 12
+#elif CELL_BITS <= 8192
+#define ADDR_BITS 13
+#elif CELL_BITS <= 16384
+#define ADDR_BITS 14
+#elif CELL_BITS <= 32768
+#define ADDR_BITS 15
+#else
+#define ADDR_BITS 16
+#endif
 
 /* Structure of the cell itself */
 typedef struct
 {
    uint16_t flags; /* 16 flags */
-   uint8_t memory[512]; /* 512 * 8 bits gives 4kbit memory */
+   uint16_t live; /* Bit p is set once page p has been written, untouched pages read as zero */
+   uint8_t *home; /* The cell's page 0 */
 } Cell;
 
 /* Function headers */
 uint8_t cell_exe(Cell *c, uint16_t addrA, uint16_t addrB, uint8_t flagR, uint8_t flagW,
               uint8_t flagC, uint16_t sense, uint8_t memTruth, uint8_t flagTruth);
 
+uint8_t cell_read(Cell *c, uint16_t addr);
+
+void cell_write(Cell *c, uint16_t addr, uint8_t value);
+
+uint8_t cell_byte(Cell *c, uint16_t byte);
+
+uint64_t cell_read_field(Cell *c, uint16_t addr, uint8_t len);
+
+void cell_write_field(Cell *c, uint16_t addr, uint8_t len, uint64_t value);
+
 #endif
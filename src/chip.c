@@ -3,87 +3,86 @@
 #include "chip.h"
 #include <stdio.h>
 
+static inline void chip_route_data(Chip *c, uint16_t data, uint32_t petitClock, uint8_t shouldOr, uint8_t slowMode,
+                            uint8_t combine);
+
 /* The chip will act as a wrapper for instructions from the machine/host. It will wrap up in 1 call the
  * instruction execution, and petit cycle management from a global petit clock in the machine.
  */
 
 void chip_exe(Chip *c, uint16_t addrA, uint16_t addrB, uint8_t flagR, uint8_t flagW, uint8_t flagC,
-              uint8_t sense, uint8_t memTruth, uint8_t flagTruth, uint8_t newsDir, uint32_t petitClock,
-              uint8_t shouldOr, uint8_t slowMode)
+              uint8_t sense, uint8_t memTruth, uint8_t flagTruth, uint32_t petitClock,
+              uint8_t shouldOr, uint8_t slowMode, uint8_t combine)
 {
-  /* First, deliver the instructions to the cells. Save their results (the flag outputs) into an array */
+  /* First, deliver the instructions to the cells. Save their results (the flag outputs) into an array,
+   * and pick up the router data flags (flag 5, so bit 10) for the router while we're there.
+   */
   uint8_t results[1 << PROCESSORS];
+  uint16_t data = 0;
   uint32_t i;
 
   for (i = 0; i < 1 << PROCESSORS; i++)
   {
     results[i] = cell_exe(c->cells[i], addrA, addrB, flagR, flagW, flagC, sense, memTruth, flagTruth);
+    data |= ((c->cells[i]->flags >> 10) & 1) << i;
   }
 
-  /* We can then write the special flags. The daisy chain is easiest - just write each index to i+1. */
+  /* We can then write the special flags. The daisy chain is easiest - just write each index to i+1. It's
+   * flag 3, so bit 12. The last cell's result carries on into the next chip, which is the machine's job.
+   */
   for (i = 0; i < (1 << PROCESSORS) - 1; i++)
   {
-    if (results[i]) c->cells[i+1]->flags |= 1 << 3;
-    else c->cells[i+1]->flags &= ~(1 << 3);
+    if (results[i]) c->cells[i+1]->flags |= 1 << 12;
+    else c->cells[i+1]->flags &= ~(1 << 12);
   }
 
-  /* The NEWS may take a bit more thinking. For ease, we assume PROCESSORS is even - that is, the cells
-   * on the chip can actually be arranged into a square. Then, we should be able to iterate over in both
-   * directions assigning as required. To reduce jumps, condition on newsDir immediately and have some
-   * redundant code. The chips are aranged left to right, top to bottom.
+  /* The NEWS grid spans the whole machine, so it can only be driven once every chip has run. Leave the
+   * outputs where the machine can pick them up.
    */
-  uint32_t j;
-  uint32_t sqw = 1 << (PROCESSORS >> 1); /* The width of the square */
-  if (newsDir == 0) /* North */
-  {
-    /* In this case, the bits move north. Each processor should set its bit to the processor below it, or
-     * +sqw in the chain
-     */
-    for (i = 0; i < (1 << PROCESSORS) - sqw; i++)
-    {
-      if (results[i+sqw]) c->cells[i]->flags |= 1 << 8;
-      else c->cells[i]->flags &= ~(1 << 8);
-    }
-  }
-  else if (newsDir == 3) /* South */
-  {
-    /* Similar to as above, but condition on the processor above instead */
-    for (i = sqw; i < (1 << PROCESSORS); i++)
-    {
-      if (results[i-sqw]) c->cells[i]->flags |= 1 << 8;
-      else c->cells[i]->flags &= ~(1 << 8);
-    }
-  }
-  else if (newsDir == 1) /* East */
+  c->outputs = 0;
+  for (i = 0; i < 1 << PROCESSORS; i++) c->outputs |= results[i] << i;
+
+  /* That's cell execution done */
+  chip_route_data(c, data, petitClock, shouldOr, slowMode, combine);
+}
+
+/* The same, for when the cells haven't just been run, so the router data flags need picking up first.
+ * Only injection and delivery look at them, so the dimension cycles can skip that.
+ */
+void chip_route(Chip *c, uint32_t petitClock, uint8_t shouldOr, uint8_t slowMode, uint8_t combine)
+{
+  uint16_t data = 0;
+  uint32_t i;
+  if (petitClock < INJECT_CYCLES || petitClock >= INJECT_CYCLES + DIMENSIONS * DIMENSION_CYCLES(slowMode))
   {
-    /* In this case, every processor excent multiples of sqw just read the -1 processor. */
-    for (i = 0; i < (1 << PROCESSORS); i++)
-    {
-      if (!(i % sqw))
-      {
-        if (results[i-1]) c->cells[i]->flags |= 1 << 8;
-        else c->cells[i]->flags &= ~(1 << 8);
-      }
-    }
+    for (i = 0; i < 1 << PROCESSORS; i++) data |= ((c->cells[i]->flags >> 10) & 1) << i;
   }
-  else if (newsDir == 2) /* Finally, west */
+  chip_route_data(c, data, petitClock, shouldOr, slowMode, combine);
+}
+
+/* The router works on every processor's router data flag at once, with data holding them as they are
+ * now, processor i at bit i. Only the cells whose flags actually change need writing back.
+ */
+static inline void chip_route_data(Chip *c, uint16_t data, uint32_t petitClock, uint8_t shouldOr, uint8_t slowMode,
+                            uint8_t combine)
+{
+  uint16_t change;
+  uint32_t i;
+
+  /* Now we need to manage the router business. The first ADDRLEN +
+   * MESSAGE_LENGTH << 3 + 3 cycles are always message injection from processors, so they can be handled
+   * first. Injection clears every router data flag, and sets the handshake (flag 4, so bit 11) of the
+   * processors whose messages were taken.
+   */
+  if (petitClock < ADDRLEN + (MESSAGE_LENGTH << 3) + 3)
   {
-    /* In this case, every processor except the last one take on the value of the +1 processor*/
-    for (i = 0; i < (1 << PROCESSORS); i++)
+    uint16_t ack = router_inject(c->router, petitClock, data, combine);
+    for (change = data | ack; change; change &= change - 1)
     {
-      if (i % sqw != sqw-1)
-      {
-        if (results[i+1]) c->cells[i]->flags |= 1 << 8;
-        else c->cells[i]->flags &= ~(1 << 8);
-      }
+      i = __builtin_ctz(change);
+      c->cells[i]->flags = (c->cells[i]->flags & ~(1 << 10)) | (((ack >> i) & 1) << 11);
     }
   }
-
-  /* That's cell execution done. Now we need to manage the router business. The first ADDRLEN +
-   * MESSAGE_LENGTH << 3 + 3 cycles are always message injection from processors, so they can be handled
-   * first.
-   */
-  if (petitClock < ADDRLEN + (MESSAGE_LENGTH << 3) + 3) router_inject(c->router, petitClock);
   /* Otherwise it'll be a dimension cycle or a delivery. Either way, we deal with petitClock - the
    * injection counter */
   else
@@ -100,7 +99,10 @@ void chip_exe(Chip *c, uint16_t addrA, uint16_t addrB, uint8_t flagR, uint8_t fl
       else newClock -= DIMENSIONS;
       
       //if (petitClock == 96) printf("here? %u\n", newClock);
-      router_deliver(c->router, newClock, shouldOr);
+      for (change = router_deliver(c->router, newClock, shouldOr) ^ data; change; change &= change - 1)
+      {
+        c->cells[__builtin_ctz(change)]->flags ^= 1 << 10;
+      }
       //if (petitClock == 96) printf("no...\n");
     }
     else /* In a dimension cycle */
@@ -125,7 +127,7 @@ void chip_exe(Chip *c, uint16_t addrA, uint16_t addrB, uint8_t flagR, uint8_t fl
   /* That should be the petit cycle done EXCEPT for receiving */
 }
 
-void chip_recv(Chip *c, uint32_t petitClock, uint8_t slowMode)
+void chip_recv(Chip *c, uint32_t petitClock, uint8_t slowMode, uint8_t combine)
 {
   /* If we're in injection or delivery cycles, do nothing */
   if (petitClock < ADDRLEN + (MESSAGE_LENGTH << 3) + 3) return;
@@ -138,10 +140,10 @@ void chip_recv(Chip *c, uint32_t petitClock, uint8_t slowMode)
   /* Now we just need to receive the right dimension if either a) we're in fast mode or b) slow mode
    * but the beginning of the dimension cycle
    */
-  if (!(slowMode)) router_receive(c->router, newClock);
+  if (!(slowMode)) router_receive(c->router, newClock, combine);
   else if (newClock % (ADDRLEN + (MESSAGE_LENGTH << 3) + 2) == 0)
   {
-    router_receive(c->router, newClock / (ADDRLEN + (MESSAGE_LENGTH << 3) + 2));
+    router_receive(c->router, newClock / (ADDRLEN + (MESSAGE_LENGTH << 3) + 2), combine);
   }
   /* Else waste the cycle */
 }
@@ -150,7 +152,8 @@ void chip_recv(Chip *c, uint32_t petitClock, uint8_t slowMode)
  * together
  */
 
-Chip *chip_build()
+/* memory is where page 0 of the chip's first cell lives, with the rest of its cells following on */
+Chip *chip_build(uint8_t *memory)
 {
   Chip *c = (Chip *)calloc(1, sizeof(Chip));
   c->router = (Router *)calloc(1, sizeof(Router));
@@ -159,7 +162,7 @@ Chip *chip_build()
   for(i = 0; i < (1 << PROCESSORS); i++)
   {
     c->cells[i] = (Cell *)calloc(1, sizeof(Cell));
-    c->router->flags[i] = &(c->cells[i]->flags);
+    c->cells[i]->home = memory + i * PAGE_BYTES;
   }
 
   return c;
@@ -175,4 +178,19 @@ void chip_del(Chip *c)
 void chip_connect(Chip *self, Chip *other, uint32_t dim)
 {
   self->router->outports[dim] = &(other->router->inports[dim]);
+  self->neighbours[dim] = other;
+}
+
+/* The cube flag (flag 6, so bit 9) of each cell takes the flag output of the same cell on the chip at the
+ * other end of the dim wire. Every chip has to have run the instruction first.
+ */
+void chip_cube(Chip *c, uint32_t dim)
+{
+  uint16_t from = c->neighbours[dim]->outputs;
+  uint32_t i;
+  for (i = 0; i < (1 << PROCESSORS); i++)
+  {
+    if ((from >> i) & 1) c->cells[i]->flags |= 1 << 9;
+    else c->cells[i]->flags &= ~(1 << 9);
+  }
 }
@@ -4,22 +4,33 @@
 #include "router.h"
 #include "cell.h"
 
-typedef struct
+/* Petit cycles are injection, then a dimension cycle per dimension, then delivery */
+#define INJECT_CYCLES (ADDRLEN + (MESSAGE_LENGTH << 3) + 3)
+#define DIMENSION_CYCLES(slow) ((slow) ? ADDRLEN + (MESSAGE_LENGTH << 3) + 2 : 1)
+#define PETIT_LENGTH(slow) (INJECT_CYCLES + DIMENSIONS * DIMENSION_CYCLES(slow) + (MESSAGE_LENGTH << 3) + 2)
+
+typedef struct cint
 {
   Router *router;
   Cell *cells[1 << PROCESSORS];
+  uint16_t outputs; /* Flag outputs of the last instruction, cell i at bit i */
+  struct cint *neighbours[DIMENSIONS]; /* The chip at the other end of each cube wire */
 } Chip;
 
 void chip_exe(Chip *c, uint16_t addrA, uint16_t addrB, uint8_t flagR, uint8_t flagW, uint8_t flagC,
-              uint8_t sense, uint8_t memTruth, uint8_t flagTruth, uint8_t newsDir, uint32_t petitClock,
-              uint8_t shouldOr, uint8_t slowMode);
+              uint8_t sense, uint8_t memTruth, uint8_t flagTruth, uint32_t petitClock,
+              uint8_t shouldOr, uint8_t slowMode, uint8_t combine);
+
+void chip_route(Chip *c, uint32_t petitClock, uint8_t shouldOr, uint8_t slowMode, uint8_t combine);
 
-void chip_recv(Chip *c, uint32_t petitClock, uint8_t slowMode);
+void chip_recv(Chip *c, uint32_t petitClock, uint8_t slowMode, uint8_t combine);
 
-Chip *chip_build();
+Chip *chip_build(uint8_t *memory);
 
 void chip_del(Chip *c);
 
 void chip_connect(Chip *self, Chip *other, uint32_t dim);
 
+void chip_cube(Chip *c, uint32_t dim);
+
 #endif
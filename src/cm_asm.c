@@ -0,0 +1,465 @@
+#include "connection_machine.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* A small assembly language for the Machine, so that whole programs (loops, polling the global pin and
+ * all) can run in the simulator without going back through host C between instructions. A program is a
+ * list of lines, each holding one of:
+ *
+ *   label:                                    a jump target, which can also prefix an instruction
+ *   exe addrA addrB flagR flagW flagC sense memTruth flagTruth [newsDir]
+ *   jmp label                                 jump
+ *   jgp label / jngp label                    jump if the global pin is / isn't set
+ *   loop N ... next                           run the enclosed lines N times, nesting up to 16 deep
+ *   sync                                      petit_sync
+ *   drain                                     no-ops until the network is empty
+ *   or / hipri / slow / fast / combine MODE   the router mode calls
+ *   halt                                      stop
+ *   .timed / .untimed                         see below
+ *
+ * Jumps can go anywhere within their own loop or out of it, but never into a loop from outside it.
+ *
+ * Truth tables can be given as numbers (decimal, 0x or 0b) or the mnemonics from connection_machine.h,
+ * and newsDir as a number or one of N E W S. Anything after a ';' is a comment, and lines (comments
+ * included) can be up to 255 characters long.
+ *
+ * Lines between .untimed and .timed are promised not to care about the router. cm_asm_optimise is then
+ * free to drop instructions from them, which changes how many cycles they take. Everything else keeps
+ * its exact cycle count.
+ */
+
+#define ASM_MAX_DEPTH 16
+#define ASM_MAX_LINE 256
+
+typedef struct
+{
+  const char *name;
+  uint8_t value;
+} asm_mnemonic;
+
+static const asm_mnemonic tables[] =
+{
+  {"AND", AND}, {"OR", OR}, {"XOR", XOR}, {"IDM", IDM}, {"IDF", IDF}, {"CPM", CPM}, {"MAJ", MAJ},
+  {"SETO", SETO}, {"SETZ", SETZ}, {"N", 0}, {"E", 1}, {"W", 2}, {"S", 3}, {NULL, 0}
+};
+
+static const asm_mnemonic numbers[] = {{NULL, 0}};
+
+static const asm_mnemonic combines[] =
+{
+  {"NONE", COMBINE_NONE}, {"OR", COMBINE_OR}, {"AND", COMBINE_AND}, {"XOR", COMBINE_XOR},
+  {"SUM", COMBINE_SUM}, {"MIN", COMBINE_MIN}, {"MAX", COMBINE_MAX}, {NULL, 0}
+};
+
+/* Parses a number or one of the given mnemonics into value, returning 0 on success */
+static int asm_value(const char *tok, uint64_t *value, const asm_mnemonic *names)
+{
+  uint32_t i;
+  if (tok == NULL) return -1;
+  for (i = 0; names[i].name; i++)
+  {
+    if (!strcmp(tok, names[i].name))
+    {
+      *value = names[i].value;
+      return 0;
+    }
+  }
+
+  /* strtoull would happily wrap a negative number around to a huge one */
+  if (tok[0] == '-') return -1;
+  char *end;
+  if (tok[0] == '0' && (tok[1] == 'b' || tok[1] == 'B')) *value = strtoull(tok + 2, &end, 2);
+  else *value = strtoull(tok, &end, 0);
+  return (*end != '\0' || end == tok) ? -1 : 0;
+}
+
+static void asm_push(cm_program *p, uint8_t op, uint64_t arg, uint8_t untimed)
+{
+  if (p->length == p->capacity)
+  {
+    p->capacity = p->capacity ? p->capacity * 2 : 64;
+    p->ops = (cm_op *)realloc(p->ops, p->capacity * sizeof(cm_op));
+  }
+  cm_op *o = &(p->ops[p->length++]);
+  o->op = op;
+  o->arg = arg;
+  o->target = 0;
+  o->untimed = untimed;
+  o->depth = 0;
+}
+
+void cm_asm_free(cm_program *p)
+{
+  if (p == NULL) return;
+  uint32_t i;
+  for (i = 0; i < p->labelCount; i++) free(p->labels[i]);
+  free(p->labels);
+  free(p->labelIndex);
+  free(p->ops);
+  free(p);
+}
+
+static int32_t asm_label(cm_program *p, const char *name)
+{
+  uint32_t i;
+  for (i = 0; i < p->labelCount; i++) if (!strcmp(p->labels[i], name)) return i;
+  return -1;
+}
+
+/* Parses a whole program from a string. Errors are reported with their line number, and give NULL */
+cm_program *cm_asm_parse(const char *text)
+{
+  cm_program *p = (cm_program *)calloc(1, sizeof(cm_program));
+  char **jumps = NULL; /* Label names for the jumps, resolved once every label has been seen */
+  uint32_t jumpCount = 0;
+  uint32_t loops[ASM_MAX_DEPTH];
+  uint32_t depth = 0, lineNo = 0;
+  uint8_t untimed = 0;
+  const char *err = NULL;
+
+  while (*text && err == NULL)
+  {
+    char line[ASM_MAX_LINE];
+    size_t len = strcspn(text, "\n");
+    lineNo++;
+    if (len >= ASM_MAX_LINE) { err = "line too long"; break; }
+    memcpy(line, text, len);
+    line[len] = '\0';
+    text += len;
+    if (*text) text++;
+
+    char *comment = strchr(line, ';');
+    if (comment) *comment = '\0';
+
+    char *save;
+    char *tok = strtok_r(line, " \t\r,", &save);
+    if (tok == NULL) continue;
+
+    /* A label, possibly followed by an instruction on the same line */
+    if (tok[strlen(tok) - 1] == ':')
+    {
+      tok[strlen(tok) - 1] = '\0';
+      if (asm_label(p, tok) >= 0) { err = "label defined twice"; break; }
+      p->labels = (char **)realloc(p->labels, (p->labelCount + 1) * sizeof(char *));
+      p->labelIndex = (uint32_t *)realloc(p->labelIndex, (p->labelCount + 1) * sizeof(uint32_t));
+      p->labels[p->labelCount] = strdup(tok);
+      p->labelIndex[p->labelCount++] = p->length;
+      tok = strtok_r(NULL, " \t\r,", &save);
+      if (tok == NULL) continue;
+    }
+
+    if (!strcmp(tok, "exe"))
+    {
+      uint64_t f[9];
+      uint32_t i;
+      for (i = 0; i < 9 && err == NULL; i++)
+      {
+        char *arg = strtok_r(NULL, " \t\r,", &save);
+        if (i == 8 && arg == NULL) f[i] = 0; /* newsDir is optional */
+        else if (asm_value(arg, &f[i], tables)) err = "bad instruction field";
+      }
+      if (err) break;
+      if (f[0] >= CELL_BITS || f[1] >= CELL_BITS || f[2] > 15 || f[3] > 15 || f[4] > 15 || f[5] > 1 || f[6] > 0xFF
+          || f[7] > 0xFF || f[8] > 3)
+      {
+        err = "instruction field out of range";
+        break;
+      }
+      asm_push(p, ASM_EXE, cm_pack(f[0], f[1], f[2], f[3], f[4], f[5], f[6], f[7], f[8]), untimed);
+    }
+    else if (!strcmp(tok, "jmp") || !strcmp(tok, "jgp") || !strcmp(tok, "jngp"))
+    {
+      char *name = strtok_r(NULL, " \t\r,", &save);
+      if (name == NULL) { err = "missing label"; break; }
+      asm_push(p, tok[1] == 'm' ? ASM_JMP : (tok[1] == 'g' ? ASM_JGP : ASM_JNGP), 0, untimed);
+      jumps = (char **)realloc(jumps, (p->length) * sizeof(char *));
+      while (jumpCount < p->length - 1) jumps[jumpCount++] = NULL;
+      jumps[jumpCount++] = strdup(name);
+    }
+    else if (!strcmp(tok, "loop"))
+    {
+      uint64_t n;
+      if (asm_value(strtok_r(NULL, " \t\r,", &save), &n, numbers)) { err = "bad loop count"; break; }
+      if (depth == ASM_MAX_DEPTH) { err = "loops nested too deeply"; break; }
+      loops[depth++] = p->length;
+      asm_push(p, ASM_LOOP, n, untimed);
+    }
+    else if (!strcmp(tok, "next"))
+    {
+      if (depth == 0) { err = "next without loop"; break; }
+      depth--;
+      asm_push(p, ASM_NEXT, 0, untimed);
+      /* The loop skips past its next when the count is 0, and the next jumps back into the body */
+      p->ops[loops[depth]].target = p->length;
+      p->ops[p->length - 1].target = loops[depth] + 1;
+    }
+    else if (!strcmp(tok, "sync")) asm_push(p, ASM_SYNC, 0, untimed);
+    else if (!strcmp(tok, "drain")) asm_push(p, ASM_DRAIN, 0, untimed);
+    else if (!strcmp(tok, "halt")) asm_push(p, ASM_HALT, 0, untimed);
+    else if (!strcmp(tok, "or")) asm_push(p, ASM_MODE, ASM_MODE_OR, untimed);
+    else if (!strcmp(tok, "hipri")) asm_push(p, ASM_MODE, ASM_MODE_HIPRI, untimed);
+    else if (!strcmp(tok, "slow")) asm_push(p, ASM_MODE, ASM_MODE_SLOW, untimed);
+    else if (!strcmp(tok, "fast")) asm_push(p, ASM_MODE, ASM_MODE_FAST, untimed);
+    else if (!strcmp(tok, "combine"))
+    {
+      uint64_t mode;
+      if (asm_value(strtok_r(NULL, " \t\r,", &save), &mode, combines) || mode > COMBINE_MAX)
+      {
+        err = "bad combine mode";
+        break;
+      }
+      asm_push(p, ASM_MODE, ASM_MODE_COMBINE + mode, untimed);
+    }
+    else if (!strcmp(tok, ".untimed")) untimed = 1;
+    else if (!strcmp(tok, ".timed")) untimed = 0;
+    else err = "unknown instruction";
+
+    if (err == NULL && strtok_r(NULL, " \t\r,", &save) != NULL) err = "unexpected text after instruction";
+  }
+
+  if (err == NULL && depth) err = "loop without next";
+
+  /* Work out which loop each op is in: scopes holds the index of the innermost loop plus one, or 0 outside
+   * of every loop, with an extra one on the end for running off the end. A loop is in the scope around
+   * it and its next in its own.
+   */
+  uint32_t i;
+  uint32_t *scopes = (uint32_t *)calloc(p->length + 1, sizeof(uint32_t));
+  if (err == NULL)
+  {
+    depth = 0;
+    for (i = 0; i < p->length; i++)
+    {
+      scopes[i] = depth ? loops[depth - 1] + 1 : 0;
+      p->ops[i].depth = depth;
+      if (p->ops[i].op == ASM_LOOP) loops[depth++] = i;
+      else if (p->ops[i].op == ASM_NEXT) depth--;
+    }
+  }
+
+  /* Labels can only be resolved now that every one has been seen. Jumps can stay in their loop or leave
+   * it for one around it, but jumping into a loop would reach its next without its count.
+   */
+  for (i = 0; i < jumpCount; i++)
+  {
+    if (jumps[i] == NULL) continue;
+    int32_t l = asm_label(p, jumps[i]);
+    if (l < 0 && err == NULL)
+    {
+      err = "undefined label";
+      lineNo = 0;
+    }
+    else if (l >= 0)
+    {
+      p->ops[i].target = p->labelIndex[l];
+      uint32_t scope = scopes[i];
+      while (scope != scopes[p->ops[i].target] && scope) scope = scopes[scope - 1];
+      if (scope != scopes[p->ops[i].target] && err == NULL)
+      {
+        err = "jump into a loop";
+        lineNo = 0;
+      }
+    }
+    free(jumps[i]);
+  }
+  free(jumps);
+  free(scopes);
+
+  if (err)
+  {
+    if (lineNo) fprintf(stderr, "cm_asm: line %u: %s\n", lineNo, err);
+    else fprintf(stderr, "cm_asm: %s\n", err);
+    cm_asm_free(p);
+    return NULL;
+  }
+  return p;
+}
+
+cm_program *cm_asm_load(const char *fileName)
+{
+  FILE *f = fopen(fileName, "rb");
+  if (f == NULL)
+  {
+    fprintf(stderr, "cm_asm: can't open %s\n", fileName);
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  long len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *text = (char *)malloc(len + 1);
+  text[fread(text, 1, len, f)] = '\0';
+  fclose(f);
+
+  cm_program *p = cm_asm_parse(text);
+  free(text);
+  return p;
+}
+
+/* The sequencer. This is the only loop the program runs in, so control flow costs next to nothing. Jumps
+ * can only ever leave loops, never enter them, so a jump just drops the counts of the loops it leaves.
+ * Returns 0 when the program halts or runs off the end, or -1 if a mode change was attempted outside of
+ * the start of a petit cycle.
+ */
+int cm_run(cm *machine, cm_program *p)
+{
+  uint64_t counts[ASM_MAX_DEPTH];
+  uint32_t depth = 0, pc = 0;
+
+  /* The sequencer runs instructions itself, so anything still queued has to go first */
+  cm_fence(machine);
+
+  while (pc < p->length)
+  {
+    cm_op *o = &(p->ops[pc]);
+    switch (o->op)
+    {
+      case ASM_EXE:
+        /* With memory in a file, ask for the next instruction's planes while this one runs */
+        if (machine->mapped && pc + 1 < p->length && p->ops[pc + 1].op == ASM_EXE)
+        {
+          cm_prefetch(machine, INS_ADDRA(p->ops[pc + 1].arg), INS_ADDRB(p->ops[pc + 1].arg));
+        }
+        cm_exe_packed(machine, o->arg);
+        pc++;
+        break;
+      case ASM_JMP:
+      case ASM_JGP:
+      case ASM_JNGP:
+        if (o->op == ASM_JMP || (o->op == ASM_JGP) == (machine->globalPin != 0))
+        {
+          pc = o->target;
+          depth = pc < p->length ? p->ops[pc].depth : 0;
+        }
+        else pc++;
+        break;
+      case ASM_LOOP:
+        if (o->arg == 0) pc = o->target;
+        else
+        {
+          counts[depth++] = o->arg;
+          pc++;
+        }
+        break;
+      case ASM_NEXT:
+        if (--counts[depth - 1]) pc = o->target;
+        else
+        {
+          depth--;
+          pc++;
+        }
+        break;
+      case ASM_SYNC:
+        petit_sync(machine);
+        pc++;
+        break;
+      case ASM_DRAIN:
+        while (network_empty(machine)) cm_exe(machine, 0, 0, 0, 0, 0, 0, IDM, IDF, 0);
+        pc++;
+        break;
+      case ASM_MODE:
+      {
+        uint8_t fail;
+        if (o->arg == ASM_MODE_OR) fail = shouldOr(machine);
+        else if (o->arg == ASM_MODE_HIPRI) fail = shouldntOr(machine);
+        else if (o->arg == ASM_MODE_SLOW) fail = slowMode(machine);
+        else if (o->arg == ASM_MODE_FAST) fail = fastMode(machine);
+        else fail = combineMode(machine, o->arg - ASM_MODE_COMBINE);
+        if (fail) return -1;
+        pc++;
+        break;
+      }
+      case ASM_HALT:
+        return 0;
+    }
+  }
+  return 0;
+}
+
+/* The peephole optimiser. It only ever drops an exe, and only one in an .untimed stretch that is
+ * directly followed by another exe (not a label, jump or anything else) which makes it unobservable.
+ * Besides its own memory and flag writes, every instruction also drives the daisy chain (flag 3), NEWS
+ * (flag 7) and, once cubeDim is set, the cube wire (flag 6) from its flag output, and recomputes the
+ * global pin. So an instruction I can go if the next one J:
+ *
+ *  - overwrites the same daisy chain, NEWS and cube cells, so has the same newsDir (the cube dimension
+ *    can't change between two exes)
+ *  - doesn't read the daisy chain, NEWS or cube flags, or anything I wrote
+ *  - and either I was a no-op to begin with (IDM into memory, and its flag write goes nowhere or writes
+ *    the read flag back to itself), or J rewrites everything I did. That means the same addrA, flagC
+ *    and sense, truth tables that ignore A, and either the same flagW or I's flagW being read only.
+ *
+ * Flag 1 is cleared after every cycle so I writing it has no effect beyond the global pin.
+ */
+
+#define ASM_RO(f) ((f) == 0 || (f) == 3 || (f) == 4 || (f) == 6 || (f) == 7)
+#define ASM_DRIVEN(f) ((f) == 3 || (f) == 6 || (f) == 7)
+
+static int asm_droppable(uint64_t i, uint64_t j)
+{
+  uint32_t iA = INS_ADDRA(i), iR = (i >> 27) & 0xF, iW = (i >> 23) & 0xF, iC = (i >> 19) & 0xF;
+  uint32_t iS = (i >> 18) & 1, iMT = (i >> 10) & 0xFF, iFT = (i >> 2) & 0xFF, iN = i & 3;
+  uint32_t jA = INS_ADDRA(j), jB = INS_ADDRB(j), jR = (j >> 27) & 0xF, jW = (j >> 23) & 0xF;
+  uint32_t jC = (j >> 19) & 0xF, jS = (j >> 18) & 1, jMT = (j >> 10) & 0xFF, jFT = (j >> 2) & 0xFF;
+  uint32_t jN = j & 3;
+
+  if (iN != jN || ASM_DRIVEN(jR) || ASM_DRIVEN(jC)) return 0;
+
+  /* What I writes into the flags, if anything lasting */
+  int iFlag = !(ASM_RO(iW) || iW == 1 || (iFT == IDF && iW == iR));
+
+  if (iMT == IDM && !iFlag) return 1;
+
+  if (iA != jA || jB == iA || iC != jC || iS != jS) return 0;
+  if (iFlag && (jR == iW || jC == iW || jW != iW)) return 0;
+  if ((jMT >> 4) != (jMT & 0xF) || (jFT >> 4) != (jFT & 0xF)) return 0;
+  return 1;
+}
+
+/* Returns the number of instructions dropped */
+uint32_t cm_asm_optimise(cm_program *p)
+{
+  uint8_t *target = (uint8_t *)calloc(p->length + 1, 1);
+  uint8_t *dead = (uint8_t *)calloc(p->length + 1, 1);
+  uint32_t *remap = (uint32_t *)malloc((p->length + 1) * sizeof(uint32_t));
+  uint32_t i, j, dropped = 0;
+
+  for (i = 0; i < p->labelCount; i++) target[p->labelIndex[i]] = 1;
+  for (i = 0; i < p->length; i++)
+  {
+    if (p->ops[i].op != ASM_EXE && p->ops[i].op != ASM_HALT && p->ops[i].op != ASM_SYNC
+        && p->ops[i].op != ASM_DRAIN && p->ops[i].op != ASM_MODE) target[p->ops[i].target] = 1;
+  }
+
+  /* Work backwards so a run of droppable instructions collapses onto the last one in a single pass */
+  for (i = p->length - 1; i + 1 > 0; i--)
+  {
+    if (p->ops[i].op != ASM_EXE || !p->ops[i].untimed) continue;
+    for (j = i + 1; j < p->length && dead[j]; j++);
+    if (j == p->length || p->ops[j].op != ASM_EXE || !p->ops[j].untimed) continue;
+    uint32_t k;
+    for (k = i + 1; k <= j && !target[k]; k++);
+    if (k <= j) continue;
+    if (asm_droppable(p->ops[i].arg, p->ops[j].arg))
+    {
+      dead[i] = 1;
+      dropped++;
+    }
+  }
+
+  /* Compact, moving jump targets and labels along with the instructions */
+  for (i = 0, j = 0; i <= p->length; i++)
+  {
+    remap[i] = j;
+    if (i < p->length && !dead[i]) p->ops[j++] = p->ops[i];
+  }
+  for (i = 0; i < j; i++) p->ops[i].target = remap[p->ops[i].target];
+  for (i = 0; i < p->labelCount; i++) p->labelIndex[i] = remap[p->labelIndex[i]];
+  p->length = j;
+
+  free(target);
+  free(dead);
+  free(remap);
+  return dropped;
+}
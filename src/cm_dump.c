@@ -8,48 +8,72 @@
  * it is best to pipe the frames into some kind of online compression?
  *
  * The data will be stored as 16 pairs of flag, mem, flag, mem, followed by the state of the router, for
- * all routers.
+ * all routers: the 7 buffer slots, the 4 listening processors and the 4 partial messages. The instruction
+ * comes last, packed as by cm_pack. Everything is in the host's byte order, and messages are written as
+ * the structs themselves (a 4 byte address, the 4 byte message, the parity byte and 3 bytes of padding).
  */
 
+/* Writes chip i as it appears in a frame into out, which needs FRAME_CHIP_BYTES. Empty router slots are
+ * written as a dummy message, with address 0xFF and everything else zero.
+ */
+static void cm_frame_chip(cm *machine, uint32_t i, uint8_t *out)
+{
+  static const Message dummy = {0xFF, {0}, 0};
+  Router *r = machine->chips[i]->router;
+  uint32_t j;
+
+  /* Cells are written out as their flags followed by their whole memory. Pages that have never been
+   * written don't need to be looked at, they're known to be zeros.
+   */
+  for (j = 0; j < (1 << PROCESSORS); j++)
+  {
+    Cell *c = machine->chips[i]->cells[j];
+    uint32_t p;
+    memcpy(out, &(c->flags), sizeof(uint16_t));
+    out += sizeof(uint16_t);
+    for (p = 0; p < CELL_PAGES; p++)
+    {
+      if ((c->live >> p) & 1) memcpy(out, c->home + p * PLANE_BYTES, PAGE_BYTES);
+      else memset(out, 0, PAGE_BYTES);
+      out += PAGE_BYTES;
+    }
+  }
+
+  for (j = 0; j < BUFSIZE; j++)
+  {
+    memcpy(out, r->buffer[j] ? r->buffer[j] : &dummy, sizeof(Message));
+    out += sizeof(Message);
+  }
+  memcpy(out, r->listening, 4 * sizeof(uint32_t));
+  out += 4 * sizeof(uint32_t);
+  for (j = 0; j < 4; j++)
+  {
+    memcpy(out, r->partials[j] ? r->partials[j] : &dummy, sizeof(Message));
+    out += sizeof(Message);
+  }
+}
+
+/* The same frame cm_dump writes, but into out, which needs FRAME_BYTES */
+void cm_snapshot(cm *machine, uint64_t ins, uint8_t *out)
+{
+  uint32_t i;
+  cm_fence(machine);
+  for (i = 0; i < (1 << DIMENSIONS); i++) cm_frame_chip(machine, i, out + (size_t)i * FRAME_CHIP_BYTES);
+  memcpy(out + (size_t)(1 << DIMENSIONS) * FRAME_CHIP_BYTES, &ins, sizeof(uint64_t));
+}
+
 void cm_dump(cm *machine, uint32_t count, uint64_t ins, const char *fileName)
 {
   char frameName[14];
   sprintf(frameName, "%u", count);
   FILE *frame = fopen(frameName, "w");
-  uint32_t i, j;
-  Message *dummy = (Message *)calloc(1, sizeof(Message));
-  dummy->address = 0xFF;
+  uint8_t chip[FRAME_CHIP_BYTES];
+  uint32_t i;
 
   for (i = 0; i < (1 << DIMENSIONS); i++)
   {
-    for (j = 0; j < (1 << PROCESSORS); j++)
-    {
-      fwrite(machine->chips[i]->cells[j], sizeof(Cell), 1, frame);
-    }
-
-    for (j = 0; j < 7; j++)
-    {
-      if (machine->chips[i]->router->buffer[j] == NULL)
-      {
-        fwrite(dummy, sizeof(Message), 1, frame);
-      }
-      else
-      {
-        fwrite(machine->chips[i]->router->buffer[j], sizeof(Message), 1, frame);
-      }
-    }
-    fwrite(machine->chips[i]->router->listening, sizeof(uint32_t), 4, frame);
-    for (j = 0; j < 4; j++)
-    {
-      if (machine->chips[i]->router->partials[j] == NULL)
-      {
-        fwrite(dummy, sizeof(Message), 1, frame);
-      }
-      else
-      {
-        fwrite(machine->chips[i]->router->partials[j], sizeof(Message), 1, frame);
-      }
-    }
+    cm_frame_chip(machine, i, chip);
+    fwrite(chip, 1, FRAME_CHIP_BYTES, frame);
   }
   fwrite(&ins, sizeof(uint64_t), 1, frame);
 
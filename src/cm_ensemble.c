@@ -0,0 +1,299 @@
+#include "connection_machine.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+/* Ensembles run the same program over many data sets at once. Rather than K separate machines each
+ * making their own pass over memory for every instruction, the ensemble keeps the K machine states
+ * interleaved: for every bit of every cell there is one 64 bit word, with member k's copy of that bit at
+ * bit k. An instruction then evaluates its truth tables on whole words, so one pass over memory and one
+ * set of word operations advances every member together.
+ *
+ * Memory is laid out address by address, with the word for each cell in turn, so an instruction touches
+ * one contiguous plane for addrA and one for addrB. Like the machine's own memory it's reserved rather
+ * than allocated, and planes that have never been written with a 1 are skipped. The flags are laid out
+ * the same way, a plane per flag.
+ *
+ * Routers can't be shared, as every member has its own messages in flight. Each member keeps a machine
+ * of its own for its router state, whose cells only ever hold the router flags (4 and 5). A member whose
+ * network is empty and that isn't trying to send anything needs no routing at all, so only members with
+ * traffic pay for copying their router flags across and running their routers.
+ */
+
+#define ENS_CELLS (1 << (DIMENSIONS + PROCESSORS))
+#define ENS_MEMORY ((size_t)CELL_BITS * ENS_CELLS * sizeof(uint64_t))
+
+/* A truth table applied to whole words. Table bit 7 - i is the result for inputs A B F = i. */
+static uint64_t ens_truth(uint8_t table, uint64_t a, uint64_t b, uint64_t f)
+{
+  uint64_t v = 0;
+  uint32_t i;
+  for (i = 0; i < 8; i++)
+  {
+    uint64_t term = ((i & 4) ? a : ~a) & ((i & 2) ? b : ~b) & ((i & 1) ? f : ~f);
+    v |= term & -(uint64_t)((table >> (7 - i)) & 1);
+  }
+  return v;
+}
+
+cm_ensemble *cm_ensemble_build(uint32_t size)
+{
+  if (size == 0 || size > 64) return NULL;
+  cm_ensemble *e = (cm_ensemble *)calloc(1, sizeof(cm_ensemble));
+  e->size = size;
+  e->lanes = (size == 64) ? ~0ULL : (1ULL << size) - 1;
+  e->memory = (uint64_t *)mmap(NULL, ENS_MEMORY, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (e->memory == MAP_FAILED)
+  {
+    free(e);
+    return NULL;
+  }
+  e->flags = (uint64_t *)calloc((size_t)16 * ENS_CELLS, sizeof(uint64_t));
+  e->outputs = (uint64_t *)calloc(ENS_CELLS, sizeof(uint64_t));
+  e->live = (uint8_t *)calloc(CELL_BITS, 1);
+
+  uint32_t k;
+  for (k = 0; k < size; k++) e->members[k] = cm_build();
+  return e;
+}
+
+void cm_ensemble_del(cm_ensemble *e)
+{
+  uint32_t k;
+  for (k = 0; k < e->size; k++) cm_del(e->members[k]);
+  munmap(e->memory, ENS_MEMORY);
+  free(e->flags);
+  free(e->outputs);
+  free(e->live);
+  free(e);
+}
+
+/* The NEWS neighbour of a cell, laid out as in cm_news, or -1 off the edge of an unwrapped grid */
+static int32_t ens_news(uint32_t cell, uint8_t newsDir, uint8_t wrap)
+{
+  uint32_t sqw = 1 << (PROCESSORS >> 1), chipsW = 1 << (DIMENSIONS >> 1), side = sqw * chipsW;
+  uint32_t chip = cell >> PROCESSORS, j = cell & ((1 << PROCESSORS) - 1);
+  int32_t r = (chip / chipsW) * sqw + j / sqw, c = (chip % chipsW) * sqw + j % sqw;
+
+  if (newsDir == 0) r++;
+  else if (newsDir == 3) r--;
+  else if (newsDir == 1) c--;
+  else c++;
+  if (r < 0 || c < 0 || r >= (int32_t)side || c >= (int32_t)side)
+  {
+    if (!wrap) return -1;
+    r = (r + side) % side;
+    c = (c + side) % side;
+  }
+  return (((r / sqw) * chipsW + c / sqw) << PROCESSORS) + (r % sqw) * sqw + c % sqw;
+}
+
+/* Members that need their routers run this cycle: anything with messages about, plus anything trying to
+ * start a message at the beginning of the petit cycle
+ */
+static uint64_t ens_routing(cm_ensemble *e)
+{
+  uint64_t sending = 0;
+  uint32_t c, k;
+  if (e->petitCounter == 0)
+  {
+    uint64_t *f5 = e->flags + 5 * ENS_CELLS;
+    for (c = 0; c < ENS_CELLS; c++) sending |= f5[c];
+  }
+  for (k = 0; k < e->size; k++)
+  {
+    if (e->busy & (1ULL << k)) sending |= 1ULL << k;
+  }
+  return sending & e->lanes;
+}
+
+/* Copies member k's router flags (4 and 5, so bits 11 and 10) into or out of its own machine */
+static void ens_router_flags(cm_ensemble *e, uint32_t k, uint8_t out)
+{
+  uint64_t *f4 = e->flags + 4 * ENS_CELLS, *f5 = e->flags + 5 * ENS_CELLS;
+  uint32_t c;
+  for (c = 0; c < ENS_CELLS; c++)
+  {
+    Cell *cell = e->members[k]->chips[c >> PROCESSORS]->cells[c & ((1 << PROCESSORS) - 1)];
+    if (out)
+    {
+      cell->flags = (cell->flags & ~(3 << 10)) | (((f4[c] >> k) & 1) << 11) | (((f5[c] >> k) & 1) << 10);
+    }
+    else
+    {
+      f4[c] = (f4[c] & ~(1ULL << k)) | ((uint64_t)((cell->flags >> 11) & 1) << k);
+      f5[c] = (f5[c] & ~(1ULL << k)) | ((uint64_t)((cell->flags >> 10) & 1) << k);
+    }
+  }
+}
+
+/* Whether a member has anything left in its network. Inports are always emptied by the receive in the
+ * same cycle, so only buffers and half injected messages need looking at.
+ */
+static uint8_t ens_network_busy(cm *member)
+{
+  uint32_t i;
+  for (i = 0; i < (1 << DIMENSIONS); i++)
+  {
+    Router *r = member->chips[i]->router;
+    if (router_empty(r) || r->partials[0]) return 1;
+  }
+  return 0;
+}
+
+void cm_ensemble_exe(cm_ensemble *e, uint16_t addrA, uint16_t addrB, uint8_t flagR, uint8_t flagW,
+                     uint8_t flagC, uint8_t sense, uint8_t memTruth, uint8_t flagTruth, uint8_t newsDir)
+{
+  uint64_t *memA = e->memory + (size_t)addrA * ENS_CELLS, *memB = e->memory + (size_t)addrB * ENS_CELLS;
+  uint64_t *fR = e->flags + flagR * ENS_CELLS, *fC = e->flags + flagC * ENS_CELLS;
+  uint64_t *fW = e->flags + flagW * ENS_CELLS;
+  uint8_t writable = !(flagW == 0 || flagW == 3 || flagW == 4 || flagW == 6 || flagW == 7);
+  uint8_t liveA = e->live[addrA], liveB = e->live[addrB];
+  uint32_t c;
+
+  /* Every member's cells at once. A cell only runs where its condition flag matches sense, and gives a
+   * flag output of 0 where it doesn't, exactly as cell_exe does.
+   */
+  for (c = 0; c < ENS_CELLS; c++)
+  {
+    uint64_t run = (sense ? fC[c] : ~fC[c]) & e->lanes;
+    uint64_t a = liveA ? memA[c] : 0, b = liveB ? memB[c] : 0, f = fR[c];
+    uint64_t memV = ens_truth(memTruth, a, b, f), flagV = ens_truth(flagTruth, a, b, f);
+    uint64_t newA = (memV & run) | (a & ~run);
+    if (newA != a)
+    {
+      liveA = e->live[addrA] = 1;
+      memA[c] = newA;
+    }
+    if (writable) fW[c] = (flagV & run) | (fW[c] & ~run);
+    e->outputs[c] = flagV & run;
+  }
+
+  /* Then the flags driven from the outputs: the daisy chain, which runs on from chip to chip, NEWS and the
+   * cube wires
+   */
+  uint64_t *daisy = e->flags + 3 * ENS_CELLS, *news = e->flags + 7 * ENS_CELLS;
+  uint64_t *cube = e->flags + 6 * ENS_CELLS;
+  for (c = 0; c < ENS_CELLS; c++)
+  {
+    daisy[c] = c ? e->outputs[c - 1] : 0;
+    int32_t from = ens_news(c, newsDir, e->newsWrap);
+    news[c] = (from < 0) ? 0 : e->outputs[from];
+    if (e->cube) cube[c] = e->outputs[c ^ (1 << (PROCESSORS + DIMENSIONS - e->cube))];
+  }
+
+  /* Routers, member by member but only for those with something to do. The rest would just be clearing
+   * the router data flag during injection and delivery, which can be done for all of them at once.
+   */
+  uint64_t routing = ens_routing(e);
+  uint32_t k, i;
+  for (k = 0; k < e->size; k++)
+  {
+    if (!((routing >> k) & 1)) continue;
+    cm *m = e->members[k];
+    ens_router_flags(e, k, 1);
+    for (i = 0; i < (1 << DIMENSIONS); i++)
+    {
+      chip_route(m->chips[i], e->petitCounter, e->shouldOr, e->slowMode, e->combine);
+    }
+    for (i = 0; i < (1 << DIMENSIONS); i++)
+    {
+      chip_recv(m->chips[i], e->petitCounter, e->slowMode, e->combine);
+    }
+    ens_router_flags(e, k, 0);
+    if (ens_network_busy(m)) e->busy |= 1ULL << k;
+    else e->busy &= ~(1ULL << k);
+  }
+  uint32_t forwarding = e->petitCounter >= INJECT_CYCLES
+                        && e->petitCounter < INJECT_CYCLES + DIMENSIONS * DIMENSION_CYCLES(e->slowMode);
+  if (!forwarding && (~routing & e->lanes))
+  {
+    uint64_t *f5 = e->flags + 5 * ENS_CELLS;
+    for (c = 0; c < ENS_CELLS; c++) f5[c] &= routing;
+  }
+
+  /* Each member's global pin, which like in cm_exe is only held for the one cycle */
+  uint64_t *global = e->flags + 1 * ENS_CELLS;
+  e->globalPins = 0;
+  for (c = 0; c < ENS_CELLS; c++)
+  {
+    e->globalPins |= global[c];
+    global[c] = 0;
+  }
+
+  e->cycle++;
+  e->petitCounter++;
+  if (e->petitCounter >= PETIT_LENGTH(e->slowMode)) e->petitCounter = 0;
+}
+
+/* The router and grid settings are shared by every member, as they all run the same instructions. Like
+ * the machine's own calls, the router ones can only change at the start of a petit cycle, so this
+ * returns -1 without changing anything if it isn't. cube is 0 for off, otherwise the dimension + 1.
+ */
+uint8_t cm_ensemble_modes(cm_ensemble *e, uint8_t shouldOr, uint8_t slowMode, uint8_t combine,
+                          uint8_t newsWrap, uint8_t cube)
+{
+  if (e->petitCounter || combine > COMBINE_MAX || cube > DIMENSIONS) return -1;
+  e->shouldOr = shouldOr;
+  e->slowMode = slowMode;
+  e->combine = combine;
+  e->newsWrap = newsWrap;
+  e->cube = cube;
+  return 0;
+}
+
+void cm_ensemble_petit_sync(cm_ensemble *e)
+{
+  while (e->petitCounter != 0) cm_ensemble_exe(e, 0, 0, 0, 0, 0, 0, IDM, IDF, 0);
+}
+
+/* Per member host access, with cells numbered as for cm_write_field */
+void cm_ensemble_write_field(cm_ensemble *e, uint32_t member, uint32_t cell, uint16_t addr, uint8_t len,
+                             uint64_t value)
+{
+  uint32_t i;
+  for (i = 0; i < len; i++)
+  {
+    uint64_t *word = e->memory + (size_t)(addr + i) * ENS_CELLS + cell;
+    uint64_t bit = (value >> (len - 1 - i)) & 1;
+    if (!e->live[addr + i] && !bit) continue;
+    e->live[addr + i] = 1;
+    *word = (*word & ~(1ULL << member)) | (bit << member);
+  }
+}
+
+uint64_t cm_ensemble_read_field(cm_ensemble *e, uint32_t member, uint32_t cell, uint16_t addr, uint8_t len)
+{
+  uint64_t v = 0;
+  uint32_t i;
+  for (i = 0; i < len; i++)
+  {
+    uint64_t word = e->live[addr + i] ? e->memory[(size_t)(addr + i) * ENS_CELLS + cell] : 0;
+    v = (v << 1) | ((word >> member) & 1);
+  }
+  return v;
+}
+
+void cm_ensemble_write_flag(cm_ensemble *e, uint32_t member, uint32_t cell, uint8_t flag, uint8_t value)
+{
+  uint64_t *word = e->flags + flag * ENS_CELLS + cell;
+  *word = (*word & ~(1ULL << member)) | ((uint64_t)(value != 0) << member);
+}
+
+uint8_t cm_ensemble_read_flag(cm_ensemble *e, uint32_t member, uint32_t cell, uint8_t flag)
+{
+  return (e->flags[flag * ENS_CELLS + cell] >> member) & 1;
+}
+
+uint8_t cm_ensemble_global_pin(cm_ensemble *e, uint32_t member)
+{
+  return (e->globalPins >> member) & 1;
+}
+
+/* Same sense as network_empty: 1 if the member still has messages in its network */
+int cm_ensemble_network_empty(cm_ensemble *e, uint32_t member)
+{
+  return network_empty(e->members[member]);
+}
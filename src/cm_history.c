@@ -0,0 +1,304 @@
+#include "connection_machine.h"
+#include "cm_trace.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Going back in time. Dumping every cycle costs tens of megabytes a cycle, so instead the machine takes a
+ * checkpoint every so many cycles and keeps a log of everything done to it in between, which is just the
+ * trace records (see cm_trace.h): instructions, mode changes and host writes. Any cycle since history
+ * started can then be rebuilt by loading the checkpoint before it into a new machine and running the log
+ * forward from there.
+ *
+ * A checkpoint holds the machine's registers, every cell's flags, every router's messages and counters,
+ * and only the memory pages that have actually been written, so a mostly empty machine checkpoints in a
+ * few hundred kilobytes. They're kept in memory, or appended to a file if one is given, with only the log
+ * staying in memory.
+ */
+
+typedef struct
+{
+  uint32_t cycle;
+  size_t record; /* Where in the log the checkpoint was taken */
+  uint8_t *data; /* NULL if it's in the file */
+  long offset;
+  size_t size;
+} cm_checkpoint;
+
+struct cm_history
+{
+  uint32_t every;
+  FILE *file;
+  uint64_t *log;
+  size_t logLength;
+  size_t logCapacity;
+  cm_checkpoint *checkpoints;
+  uint32_t count;
+  uint32_t capacity;
+};
+
+/* cm_build starts the cycle count again, and so does anything else it runs, which mustn't happen to the
+ * machine being looked back on
+ */
+extern uint32_t count;
+
+typedef struct
+{
+  uint8_t *data;
+  size_t length;
+  size_t capacity;
+} history_buffer;
+
+static void history_put(history_buffer *b, const void *data, size_t len)
+{
+  if (b->length + len > b->capacity)
+  {
+    while (b->length + len > b->capacity) b->capacity = b->capacity ? b->capacity * 2 : 1 << 16;
+    b->data = (uint8_t *)realloc(b->data, b->capacity);
+  }
+  memcpy(b->data + b->length, data, len);
+  b->length += len;
+}
+
+static const uint8_t *history_get(const uint8_t *from, void *data, size_t len)
+{
+  memcpy(data, from, len);
+  return from + len;
+}
+
+/* Messages go in as a byte saying whether there is one, then the message itself */
+static void history_put_message(history_buffer *b, const Message *m)
+{
+  uint8_t present = m != NULL;
+  history_put(b, &present, 1);
+  if (m) history_put(b, m, sizeof(Message));
+}
+
+static const uint8_t *history_get_message(const uint8_t *from, Message **m)
+{
+  uint8_t present;
+  from = history_get(from, &present, 1);
+  *m = NULL;
+  if (!present) return from;
+  *m = (Message *)malloc(sizeof(Message));
+  return history_get(from, *m, sizeof(Message));
+}
+
+static void history_checkpoint(cm *machine)
+{
+  struct cm_history *h = machine->history;
+  history_buffer b = {NULL, 0, 0};
+  uint32_t i, j, p;
+
+  history_put(&b, &(machine->cycle), sizeof(uint32_t));
+  history_put(&b, &(machine->petitCounter), sizeof(uint32_t));
+  uint8_t registers[6] = {machine->shouldOr, machine->slowMode, machine->combine, machine->newsWrap,
+                          machine->cube, machine->globalPin};
+  history_put(&b, registers, sizeof(registers));
+
+  for (i = 0; i < (1 << DIMENSIONS); i++)
+  {
+    Chip *c = machine->chips[i];
+    Router *r = c->router;
+    history_put(&b, &(c->outputs), sizeof(uint16_t));
+    for (j = 0; j < (1 << PROCESSORS); j++)
+    {
+      history_put(&b, &(c->cells[j]->flags), sizeof(uint16_t));
+      history_put(&b, &(c->cells[j]->live), sizeof(uint16_t));
+    }
+    for (j = 0; j < BUFSIZE; j++) history_put_message(&b, r->buffer[j]);
+    for (j = 0; j < DIMENSIONS; j++) history_put_message(&b, r->inports[j]);
+    for (j = 0; j < 4; j++) history_put_message(&b, r->partials[j]);
+    history_put(&b, r->listening, sizeof(r->listening));
+    uint32_t counters[4] = {r->combined, r->referred, r->parityFailed, r->delivered};
+    history_put(&b, counters, sizeof(counters));
+  }
+
+  /* Memory goes in a plane at a time, in the same order as it's laid out, skipping pages never written */
+  for (p = 0; p < CELL_PAGES; p++)
+  {
+    for (i = 0; i < (1 << DIMENSIONS); i++)
+    {
+      for (j = 0; j < (1 << PROCESSORS); j++)
+      {
+        Cell *c = machine->chips[i]->cells[j];
+        if ((c->live >> p) & 1) history_put(&b, c->home + p * PLANE_BYTES, PAGE_BYTES);
+      }
+    }
+  }
+
+  if (h->count == h->capacity)
+  {
+    h->capacity = h->capacity ? h->capacity * 2 : 16;
+    h->checkpoints = (cm_checkpoint *)realloc(h->checkpoints, h->capacity * sizeof(cm_checkpoint));
+  }
+  cm_checkpoint *k = &(h->checkpoints[h->count++]);
+  k->cycle = machine->cycle;
+  k->record = h->logLength;
+  k->size = b.length;
+  k->data = NULL;
+  if (h->file)
+  {
+    fseek(h->file, 0, SEEK_END);
+    k->offset = ftell(h->file);
+    fwrite(b.data, 1, b.length, h->file);
+    free(b.data);
+  }
+  else k->data = (uint8_t *)realloc(b.data, b.length);
+}
+
+/* Loads a checkpoint into a machine fresh from cm_build */
+static void history_restore(cm *machine, const uint8_t *from)
+{
+  uint32_t i, j, p;
+  from = history_get(from, &(machine->cycle), sizeof(uint32_t));
+  from = history_get(from, &(machine->petitCounter), sizeof(uint32_t));
+  uint8_t registers[6];
+  from = history_get(from, registers, sizeof(registers));
+  machine->shouldOr = registers[0];
+  machine->slowMode = registers[1];
+  machine->combine = registers[2];
+  machine->newsWrap = registers[3];
+  machine->cube = registers[4];
+  machine->globalPin = registers[5];
+
+  for (i = 0; i < (1 << DIMENSIONS); i++)
+  {
+    Chip *c = machine->chips[i];
+    Router *r = c->router;
+    from = history_get(from, &(c->outputs), sizeof(uint16_t));
+    for (j = 0; j < (1 << PROCESSORS); j++)
+    {
+      from = history_get(from, &(c->cells[j]->flags), sizeof(uint16_t));
+      from = history_get(from, &(c->cells[j]->live), sizeof(uint16_t));
+    }
+    for (j = 0; j < BUFSIZE; j++) from = history_get_message(from, &(r->buffer[j]));
+    for (j = 0; j < DIMENSIONS; j++) from = history_get_message(from, &(r->inports[j]));
+    for (j = 0; j < 4; j++) from = history_get_message(from, &(r->partials[j]));
+    from = history_get(from, r->listening, sizeof(r->listening));
+    uint32_t counters[4];
+    from = history_get(from, counters, sizeof(counters));
+    r->combined = counters[0];
+    r->referred = counters[1];
+    r->parityFailed = counters[2];
+    r->delivered = counters[3];
+  }
+
+  for (p = 0; p < CELL_PAGES; p++)
+  {
+    for (i = 0; i < (1 << DIMENSIONS); i++)
+    {
+      for (j = 0; j < (1 << PROCESSORS); j++)
+      {
+        Cell *c = machine->chips[i]->cells[j];
+        if ((c->live >> p) & 1) from = history_get(from, c->home + p * PLANE_BYTES, PAGE_BYTES);
+      }
+    }
+  }
+}
+
+/* Starts keeping history, with a checkpoint every `every` cycles from now, starting with one straight
+ * away. Checkpoints are appended to fileName, or kept in memory if it's NULL. Unlike tracing this can
+ * start at any point, but host writes should go through cm_write_field and cm_write_flag from then on so
+ * they're logged. Returns 0 on success, -1 if history is already being kept, every is 0 or the file
+ * can't be opened.
+ */
+int cm_history_start(cm *machine, uint32_t every, const char *fileName)
+{
+  cm_fence(machine);
+  if (machine->history || every == 0) return -1;
+  struct cm_history *h = (struct cm_history *)calloc(1, sizeof(struct cm_history));
+  h->every = every;
+  if (fileName)
+  {
+    h->file = fopen(fileName, "w+b");
+    if (h->file == NULL)
+    {
+      free(h);
+      return -1;
+    }
+  }
+  machine->history = h;
+  history_checkpoint(machine);
+  return 0;
+}
+
+void cm_history_stop(cm *machine)
+{
+  struct cm_history *h = machine->history;
+  if (h == NULL) return;
+  cm_fence(machine);
+  uint32_t i;
+  for (i = 0; i < h->count; i++) free(h->checkpoints[i].data);
+  free(h->checkpoints);
+  free(h->log);
+  if (h->file) fclose(h->file);
+  free(h);
+  machine->history = NULL;
+}
+
+/* Adds a record to the log, from cm_trace_record */
+void cm_history_record(cm *machine, uint64_t record)
+{
+  struct cm_history *h = machine->history;
+  if (h->logLength == h->logCapacity)
+  {
+    h->logCapacity = h->logCapacity ? h->logCapacity * 2 : 1 << 12;
+    h->log = (uint64_t *)realloc(h->log, h->logCapacity * sizeof(uint64_t));
+  }
+  h->log[h->logLength++] = record;
+}
+
+/* Called by cm_exe once the cycle is over */
+void cm_history_step(cm *machine)
+{
+  struct cm_history *h = machine->history;
+  if ((machine->cycle - h->checkpoints[0].cycle) % h->every == 0) history_checkpoint(machine);
+}
+
+/* Rebuilds the machine as it was just before instruction number `cycle` ran, with every host write made
+ * before then. The result is a new machine of its own, for looking at and running on however the caller
+ * likes, and needs deleting with cm_del. Stepping backwards is just asking for the cycle before. Returns
+ * NULL if history isn't being kept, or didn't start until after that cycle, or the cycle hasn't happened
+ * yet.
+ */
+cm *cm_state_at(cm *machine, uint32_t cycle)
+{
+  struct cm_history *h = machine->history;
+  cm_fence(machine);
+  if (h == NULL || cycle < h->checkpoints[0].cycle || cycle > machine->cycle) return NULL;
+
+  /* The last checkpoint at or before the cycle */
+  uint32_t low = 0, high = h->count;
+  while (high - low > 1)
+  {
+    uint32_t mid = (low + high) / 2;
+    if (h->checkpoints[mid].cycle <= cycle) low = mid;
+    else high = mid;
+  }
+  cm_checkpoint *k = &(h->checkpoints[low]);
+
+  uint8_t *data = k->data;
+  if (data == NULL)
+  {
+    data = (uint8_t *)malloc(k->size);
+    fseek(h->file, k->offset, SEEK_SET);
+    if (fread(data, 1, k->size, h->file) != k->size)
+    {
+      free(data);
+      return NULL;
+    }
+  }
+
+  uint32_t saved = count;
+  cm *past = cm_build();
+  if (past)
+  {
+    history_restore(past, data);
+    cm_trace_apply(past, h->log, h->logLength, k->record, cycle);
+  }
+  count = saved;
+  if (data != k->data) free(data);
+  return past;
+}
@@ -0,0 +1,237 @@
+#include "connection_machine.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* A message level model of the router network, for when what matters is when messages arrive rather than
+ * what every cell's flags are doing on the way. The accurate engine spends most of a petit cycle moving
+ * messages in and out one bit at a time on every cell; here a message goes into a router whole and comes
+ * out whole, so the only work left is the routing itself.
+ *
+ * The routing is exactly the accurate engine's. The network is built from the same Routers, wired the same
+ * way, and each petit cycle runs router_forward and router_receive over the dimensions in the same order,
+ * so buffer limits, referral and combining all behave identically. Injection follows router_inject's rules
+ * - each router takes at most 4 messages a petit cycle, from its lowest numbered processors first, and no
+ * more than it has free buffer slots - and delivery uses router_retire, just as router_deliver does.
+ *
+ * A processor whose message isn't taken offers it again the next petit cycle, as a program checking the
+ * router acknowledge flag would. Deliveries are reported with the cycle their handshake bit would arrive on
+ * the accurate engine, counting from a machine starting at cycle 0.
+ */
+
+#define NET_CELLS (1 << (DIMENSIONS + PROCESSORS))
+
+typedef struct net_pending
+{
+  uint32_t dest;
+  uint8_t message[MESSAGE_LENGTH];
+  struct net_pending *next;
+} net_pending;
+
+cm_msgnet *cm_msgnet_build(uint8_t shouldOr, uint8_t slowMode, uint8_t combine)
+{
+  if (combine > COMBINE_MAX) return NULL;
+  cm_msgnet *n = (cm_msgnet *)calloc(1, sizeof(cm_msgnet));
+  n->shouldOr = shouldOr;
+  n->slowMode = slowMode;
+  n->combine = combine;
+  n->heads = (net_pending **)calloc(NET_CELLS, sizeof(net_pending *));
+  n->tails = (net_pending **)calloc(NET_CELLS, sizeof(net_pending *));
+  n->offering = (uint16_t *)calloc(1 << DIMENSIONS, sizeof(uint16_t));
+
+  /* Wired up just as in cm_build */
+  uint32_t i, dim;
+  for (i = 0; i < (1 << DIMENSIONS); i++)
+  {
+    n->routers[i] = (Router *)calloc(1, sizeof(Router));
+    n->routers[i]->id = i;
+  }
+  for (i = 0; i < (1 << DIMENSIONS); i++)
+  {
+    n->routers[i]->referer = n->routers[(i + 1) % (1 << DIMENSIONS)];
+    for (dim = 0; dim < DIMENSIONS; dim++)
+    {
+      n->routers[i]->outports[DIMENSIONS - 1 - dim] =
+        &(n->routers[i ^ (1 << dim)]->inports[DIMENSIONS - 1 - dim]);
+    }
+  }
+  return n;
+}
+
+void cm_msgnet_del(cm_msgnet *n)
+{
+  uint32_t i, j;
+  for (i = 0; i < (1 << DIMENSIONS); i++)
+  {
+    for (j = 0; j < BUFSIZE; j++) free(n->routers[i]->buffer[j]);
+    free(n->routers[i]);
+  }
+  for (i = 0; i < NET_CELLS; i++)
+  {
+    while (n->heads[i])
+    {
+      net_pending *p = n->heads[i];
+      n->heads[i] = p->next;
+      free(p);
+    }
+  }
+  free(n->heads);
+  free(n->tails);
+  free(n->offering);
+  free(n->deliveries);
+  free(n);
+}
+
+/* Queues a message from source to dest, both numbered as for cm_write_field. It's first offered at the
+ * start of the next petit cycle, behind anything source already has waiting.
+ */
+void cm_msgnet_send(cm_msgnet *n, uint32_t source, uint32_t dest, const uint8_t *message)
+{
+  net_pending *p = (net_pending *)malloc(sizeof(net_pending));
+  p->dest = dest;
+  memcpy(p->message, message, MESSAGE_LENGTH);
+  p->next = NULL;
+  if (n->tails[source]) n->tails[source]->next = p;
+  else
+  {
+    n->heads[source] = p;
+    n->offering[source >> PROCESSORS] |= 1 << (source & ((1 << PROCESSORS) - 1));
+  }
+  n->tails[source] = p;
+  n->waiting++;
+}
+
+/* The injection half of the petit cycle, as router_inject would leave things at its parity bit */
+static void net_inject(cm_msgnet *n, uint32_t r)
+{
+  Router *router = n->routers[r];
+  uint32_t accNo = 0, taken = 0, j;
+  while (accNo < BUFSIZE && router->buffer[accNo] != NULL) accNo++;
+  accNo = BUFSIZE - accNo;
+  if (accNo > 4) accNo = 4;
+
+  for (j = 0; j < (1 << PROCESSORS); j++)
+  {
+    if (!((n->offering[r] >> j) & 1)) continue;
+    if (taken == accNo)
+    {
+      n->retries++;
+      continue;
+    }
+    taken++;
+
+    uint32_t source = (r << PROCESSORS) | j;
+    net_pending *p = n->heads[source];
+    Message *m = (Message *)calloc(1, sizeof(Message));
+    uint32_t b;
+    m->address = (((p->dest >> PROCESSORS) ^ r) << PROCESSORS) | (p->dest & ((1 << PROCESSORS) - 1));
+    memcpy(m->message, p->message, MESSAGE_LENGTH);
+    for (b = 0; b < MESSAGE_LENGTH; b++) m->parity ^= __builtin_parity(m->message[b]);
+
+    if (!router_combine(router, m, n->combine))
+    {
+      uint32_t k = 0;
+      while (router->buffer[k]) k++;
+      router->buffer[k] = m;
+    }
+
+    n->heads[source] = p->next;
+    if (p->next == NULL)
+    {
+      n->tails[source] = NULL;
+      n->offering[r] &= ~(1 << j);
+    }
+    free(p);
+    n->waiting--;
+  }
+}
+
+static void net_deliver(cm_msgnet *n, Router *router, uint32_t cycle)
+{
+  Message *retired[BUFSIZE];
+  uint32_t count = router_retire(router, n->shouldOr, retired), i;
+  for (i = 0; i < count; i++)
+  {
+    if (n->deliveryCount == n->deliveryCapacity)
+    {
+      n->deliveryCapacity = n->deliveryCapacity ? n->deliveryCapacity * 2 : 1024;
+      n->deliveries = (cm_delivery *)realloc(n->deliveries, n->deliveryCapacity * sizeof(cm_delivery));
+    }
+    cm_delivery *d = &(n->deliveries[n->deliveryCount++]);
+    d->dest = (router->id << PROCESSORS) | (retired[i]->address & ((1 << PROCESSORS) - 1));
+    d->cycle = cycle;
+    memcpy(d->message, retired[i]->message, MESSAGE_LENGTH);
+    free(retired[i]);
+  }
+}
+
+/* Runs one petit cycle and returns how many messages were delivered in it */
+uint32_t cm_msgnet_petit(cm_msgnet *n)
+{
+  uint32_t before = n->deliveryCount, r, dim;
+
+  for (r = 0; r < (1 << DIMENSIONS); r++) if (n->offering[r]) net_inject(n, r);
+
+  /* Buffers are always packed to the front, so an empty first slot means nothing to forward. Every router
+   * forwards before any receive, just as every chip routes before any chip_recv.
+   */
+  for (dim = 0; dim < DIMENSIONS; dim++)
+  {
+    for (r = 0; r < (1 << DIMENSIONS); r++)
+    {
+      if (n->routers[r]->buffer[0]) router_forward(n->routers[r], dim);
+    }
+    for (r = 0; r < (1 << DIMENSIONS); r++)
+    {
+      if (n->routers[r]->inports[dim]) router_receive(n->routers[r], dim, n->combine);
+    }
+  }
+
+  uint32_t cycle = n->petit * PETIT_LENGTH(n->slowMode) + INJECT_CYCLES
+                   + DIMENSIONS * DIMENSION_CYCLES(n->slowMode);
+  for (r = 0; r < (1 << DIMENSIONS); r++)
+  {
+    if (n->routers[r]->buffer[0]) net_deliver(n, n->routers[r], cycle);
+  }
+  n->petit++;
+  return n->deliveryCount - before;
+}
+
+/* Whether there's anything still to be sent or delivered */
+int cm_msgnet_busy(cm_msgnet *n)
+{
+  uint32_t r;
+  if (n->waiting) return 1;
+  for (r = 0; r < (1 << DIMENSIONS); r++) if (router_empty(n->routers[r])) return 1;
+  return 0;
+}
+
+/* Runs petit cycles until every message has been delivered, or limit petit cycles have gone by. Returns
+ * the number run, or -1 if it hit the limit.
+ */
+int64_t cm_msgnet_run(cm_msgnet *n, uint32_t limit)
+{
+  uint32_t start = n->petit;
+  while (cm_msgnet_busy(n))
+  {
+    if (n->petit - start == limit) return -1;
+    cm_msgnet_petit(n);
+  }
+  return n->petit - start;
+}
+
+/* Totals over every router */
+uint32_t cm_msgnet_referred(cm_msgnet *n)
+{
+  uint32_t r, total = 0;
+  for (r = 0; r < (1 << DIMENSIONS); r++) total += n->routers[r]->referred;
+  return total;
+}
+
+uint32_t cm_msgnet_combined(cm_msgnet *n)
+{
+  uint32_t r, total = 0;
+  for (r = 0; r < (1 << DIMENSIONS); r++) total += n->routers[r]->combined;
+  return total;
+}
@@ -0,0 +1,215 @@
+#include "connection_machine.h"
+#include "cm_profile.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* cycles() gives a single number for the whole run, which doesn't say where the cycles went. Regions let
+ * the host mark out the parts of a program it cares about, and keep totals for each: cycles simulated,
+ * how many of those the program asked for itself, host time, cycles spent waiting on the router and
+ * messages delivered. Regions nest, and the same region entered from different places is kept
+ * separately for each, so the result is a call tree.
+ *
+ * Waiting on the router means the no-ops petit_sync pads with, and anything run between a network_empty
+ * that found the network busy and the next call to network_empty - the usual drain loop.
+ *
+ * The tree is written out in the folded stack format that flame graph tools read: a line per region,
+ * the names from the outermost down separated by semicolons, then the region's own count, not including
+ * what its children took.
+ */
+
+#define PROFILE_DEPTH 64
+
+typedef struct
+{
+  char *name;
+  int32_t parent;
+  uint64_t totals[PROFILE_METRICS];
+} cm_region;
+
+typedef struct
+{
+  int32_t node;
+  uint64_t start[PROFILE_METRICS];
+} cm_open_region;
+
+struct cm_profile
+{
+  cm_region *regions;
+  uint32_t count;
+  uint32_t capacity;
+  cm_open_region stack[PROFILE_DEPTH];
+  uint32_t depth;
+  uint64_t padded; /* Cycles run by petit_sync */
+  uint64_t drained; /* Cycles run while waiting for the network to empty */
+  uint8_t draining;
+  uint32_t drainFrom;
+};
+
+static uint64_t profile_now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+/* Where every counter stands right now. Regions keep the difference between their end and start. */
+static void profile_read(cm *machine, uint64_t *now)
+{
+  struct cm_profile *p = machine->profile;
+  uint32_t i;
+  now[PROFILE_CYCLES] = machine->cycle;
+  now[PROFILE_CALLS] = machine->cycle - p->padded;
+  now[PROFILE_WALL] = profile_now();
+  now[PROFILE_STALL] = p->padded + p->drained;
+  /* A drain still going on counts up to now, so a region ending part way through one gets its share */
+  if (p->draining) now[PROFILE_STALL] += machine->cycle - p->drainFrom;
+  now[PROFILE_MESSAGES] = 0;
+  for (i = 0; i < (1 << DIMENSIONS); i++) now[PROFILE_MESSAGES] += machine->chips[i]->router->delivered;
+}
+
+/* Finds the child of parent called name, or adds it */
+static int32_t profile_node(struct cm_profile *p, int32_t parent, const char *name)
+{
+  uint32_t i;
+  for (i = 0; i < p->count; i++)
+  {
+    if (p->regions[i].parent == parent && !strcmp(p->regions[i].name, name)) return i;
+  }
+  if (p->count == p->capacity)
+  {
+    p->capacity = p->capacity ? p->capacity * 2 : 16;
+    p->regions = (cm_region *)realloc(p->regions, p->capacity * sizeof(cm_region));
+  }
+  cm_region *r = &(p->regions[p->count]);
+  memset(r, 0, sizeof(cm_region));
+  r->name = strdup(name);
+  r->parent = parent;
+  return p->count++;
+}
+
+/* Starts a region inside whichever one is open. Returns -1 if they're nested too deep, or if the name
+ * is empty or has a ';' or whitespace in it, since those would break up the folded stack lines. */
+uint8_t cm_region_begin(cm *machine, const char *name)
+{
+  if (name == NULL || name[0] == '\0' || name[strcspn(name, "; \t\n\r\v\f")] != '\0') return -1;
+  cm_fence(machine);
+  if (machine->profile == NULL)
+  {
+    machine->profile = (struct cm_profile *)calloc(1, sizeof(struct cm_profile));
+  }
+  struct cm_profile *p = machine->profile;
+  if (p->depth == PROFILE_DEPTH) return -1;
+
+  int32_t parent = p->depth ? p->stack[p->depth - 1].node : -1;
+  cm_open_region *o = &(p->stack[p->depth]);
+  o->node = profile_node(p, parent, name);
+  p->depth++;
+  profile_read(machine, o->start);
+  return 0;
+}
+
+/* Ends the innermost open region. Returns -1 if there isn't one. */
+uint8_t cm_region_end(cm *machine)
+{
+  cm_fence(machine);
+  struct cm_profile *p = machine->profile;
+  if (p == NULL || p->depth == 0) return -1;
+
+  uint64_t now[PROFILE_METRICS];
+  uint32_t m;
+  profile_read(machine, now);
+  p->depth--;
+  cm_open_region *o = &(p->stack[p->depth]);
+  for (m = 0; m < PROFILE_METRICS; m++) p->regions[o->node].totals[m] += now[m] - o->start[m];
+  return 0;
+}
+
+void cm_profile_stall(cm *machine, uint32_t cycles)
+{
+  machine->profile->padded += cycles;
+}
+
+/* Called by network_empty with what it found. Cycles since a poll that found the network busy were spent
+ * waiting for it.
+ */
+void cm_profile_poll(cm *machine, int busy)
+{
+  struct cm_profile *p = machine->profile;
+  if (p->draining) p->drained += machine->cycle - p->drainFrom;
+  p->draining = busy;
+  p->drainFrom = machine->cycle;
+}
+
+static void profile_path(struct cm_profile *p, int32_t node, FILE *out)
+{
+  if (p->regions[node].parent >= 0)
+  {
+    profile_path(p, p->regions[node].parent, out);
+    fputc(';', out);
+  }
+  fputs(p->regions[node].name, out);
+}
+
+/* A region's own share of a metric, without what was counted against the regions inside it */
+static uint64_t profile_self(struct cm_profile *p, int32_t node, uint8_t metric)
+{
+  uint64_t self = p->regions[node].totals[metric];
+  uint32_t i;
+  for (i = 0; i < p->count; i++)
+  {
+    if (p->regions[i].parent == node) self -= p->regions[i].totals[metric];
+  }
+  return self;
+}
+
+/* Writes one metric out in folded stack format. Regions still open only count up to when they were last
+ * ended. Returns -1 if there's nothing to write or the file can't be opened.
+ */
+int cm_profile_write(cm *machine, const char *fileName, uint8_t metric)
+{
+  struct cm_profile *p = machine->profile;
+  if (p == NULL || metric >= PROFILE_METRICS) return -1;
+  FILE *out = fopen(fileName, "w");
+  if (out == NULL) return -1;
+
+  uint32_t i;
+  for (i = 0; i < p->count; i++)
+  {
+    profile_path(p, i, out);
+    fprintf(out, " %llu\n", (unsigned long long)profile_self(p, i, metric));
+  }
+  fclose(out);
+  return 0;
+}
+
+/* Prints every region's totals, children included, in the same way cycles() does */
+void cm_profile_print(cm *machine)
+{
+  struct cm_profile *p = machine->profile;
+  if (p == NULL) return;
+  uint32_t i;
+  printf("%10s %10s %12s %10s %10s  region\n", "cycles", "calls", "wall us", "stalled", "messages");
+  for (i = 0; i < p->count; i++)
+  {
+    uint64_t *t = p->regions[i].totals;
+    printf("%10llu %10llu %12llu %10llu %10llu  ", (unsigned long long)t[PROFILE_CYCLES],
+           (unsigned long long)t[PROFILE_CALLS], (unsigned long long)t[PROFILE_WALL],
+           (unsigned long long)t[PROFILE_STALL], (unsigned long long)t[PROFILE_MESSAGES]);
+    profile_path(p, i, stdout);
+    putchar('\n');
+  }
+}
+
+void cm_profile_del(cm *machine)
+{
+  struct cm_profile *p = machine->profile;
+  if (p == NULL) return;
+  uint32_t i;
+  for (i = 0; i < p->count; i++) free(p->regions[i].name);
+  free(p->regions);
+  free(p);
+  machine->profile = NULL;
+}
@@ -0,0 +1,14 @@
+#ifndef CM_PROFILE_H_
+#define CM_PROFILE_H_
+
+#include "connection_machine.h"
+
+/* Hooks for the rest of the library to tell the profiler about time spent waiting on the router. Only
+ * called while a profile is running.
+ */
+
+void cm_profile_stall(cm *machine, uint32_t cycles);
+
+void cm_profile_poll(cm *machine, int busy);
+
+#endif
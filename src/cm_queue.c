@@ -0,0 +1,151 @@
+#include "connection_machine.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+
+/* Asynchronous instruction submission. Host drivers spend a lot of their time working out the next
+ * instruction while the simulator sits idle, and the other way around. Instead, cm_submit pushes packed
+ * instructions into a single producer, single consumer ring, and a dedicated thread pulls them off and
+ * runs them. The host only waits when it really needs a result: cm_fence for everything to finish,
+ * cm_wait_global_pin for the pin, and network_empty and the host reads and writes fence on their own.
+ *
+ * The ring indices only ever count up, the producer owning head and the consumer tail, so neither side
+ * needs a lock. Whoever is waiting spins for a while and then starts yielding the processor.
+ */
+
+#define QUEUE_SIZE 4096 /* Must be a power of 2 */
+#define QUEUE_SPINS 1024
+
+struct cm_queue
+{
+  uint64_t ring[QUEUE_SIZE];
+  _Atomic uint64_t head; /* Next slot the host will fill */
+  _Atomic uint64_t tail; /* Next slot the simulation thread will run */
+  _Atomic int running;
+  pthread_t thread;
+};
+
+static void queue_wait(uint32_t *spins)
+{
+  if (++(*spins) > QUEUE_SPINS) sched_yield();
+}
+
+static void *queue_run(void *arg)
+{
+  cm *machine = (cm *)arg;
+  struct cm_queue *q = machine->queue;
+  uint64_t tail = atomic_load_explicit(&(q->tail), memory_order_relaxed);
+  uint32_t spins = 0;
+
+  while (1)
+  {
+    uint64_t head = atomic_load_explicit(&(q->head), memory_order_acquire);
+    if (head == tail)
+    {
+      if (!atomic_load_explicit(&(q->running), memory_order_acquire)) break;
+      queue_wait(&spins);
+      continue;
+    }
+    spins = 0;
+
+    /* Run everything available before publishing progress, so the host sees fewer cache misses */
+    while (tail != head)
+    {
+      /* The queue shows what's coming, so with memory in a file the next planes can be read in early */
+      if (machine->mapped && tail + 1 != head)
+      {
+        uint64_t next = q->ring[(tail + 1) & (QUEUE_SIZE - 1)];
+        cm_prefetch(machine, INS_ADDRA(next), INS_ADDRB(next));
+      }
+      cm_exe_packed(machine, q->ring[tail & (QUEUE_SIZE - 1)]);
+      tail++;
+      atomic_store_explicit(&(q->tail), tail, memory_order_release);
+    }
+  }
+  return NULL;
+}
+
+/* Starts the simulation thread. Returns 0 on success, or -1 if it's already running or can't start */
+int cm_async_start(cm *machine)
+{
+  if (machine->queue) return -1;
+  struct cm_queue *q = (struct cm_queue *)calloc(1, sizeof(struct cm_queue));
+  atomic_store(&(q->running), 1);
+  machine->queue = q;
+  if (pthread_create(&(q->thread), NULL, queue_run, machine))
+  {
+    machine->queue = NULL;
+    free(q);
+    return -1;
+  }
+  return 0;
+}
+
+/* Finishes everything submitted and stops the thread. cm_del does this too. */
+void cm_async_stop(cm *machine)
+{
+  struct cm_queue *q = machine->queue;
+  if (q == NULL) return;
+  atomic_store_explicit(&(q->running), 0, memory_order_release);
+  pthread_join(q->thread, NULL);
+  machine->queue = NULL;
+  free(q);
+}
+
+void cm_submit_packed(cm *machine, uint64_t ins)
+{
+  struct cm_queue *q = machine->queue;
+  if (q == NULL)
+  {
+    cm_exe_packed(machine, ins);
+    return;
+  }
+
+  uint64_t head = atomic_load_explicit(&(q->head), memory_order_relaxed);
+  uint32_t spins = 0;
+  while (head - atomic_load_explicit(&(q->tail), memory_order_acquire) == QUEUE_SIZE) queue_wait(&spins);
+  q->ring[head & (QUEUE_SIZE - 1)] = ins;
+  atomic_store_explicit(&(q->head), head + 1, memory_order_release);
+}
+
+/* Submits n packed instructions in one go, the same as calling cm_submit_packed for each. Without a
+ * simulation thread to do it, the next instruction's planes are asked for here.
+ */
+void cm_submit_batch(cm *machine, const uint64_t *ins, uint32_t n)
+{
+  uint32_t i;
+  for (i = 0; i < n; i++)
+  {
+    if (machine->queue == NULL && machine->mapped && i + 1 < n)
+    {
+      cm_prefetch(machine, INS_ADDRA(ins[i + 1]), INS_ADDRB(ins[i + 1]));
+    }
+    cm_submit_packed(machine, ins[i]);
+  }
+}
+
+/* Same arguments as cm_exe. Without a simulation thread running this just is cm_exe. */
+void cm_submit(cm *machine, uint16_t addrA, uint16_t addrB, uint8_t flagR, uint8_t flagW, uint8_t flagC,
+               uint8_t sense, uint8_t memTruth, uint8_t flagTruth, uint8_t newsDir)
+{
+  cm_submit_packed(machine, cm_pack(addrA, addrB, flagR, flagW, flagC, sense, memTruth, flagTruth,
+                                    newsDir));
+}
+
+/* Waits until every submitted instruction has run. Afterwards the host can look at anything. */
+void cm_fence(cm *machine)
+{
+  struct cm_queue *q = machine->queue;
+  if (q == NULL) return;
+  uint64_t head = atomic_load_explicit(&(q->head), memory_order_relaxed);
+  uint32_t spins = 0;
+  while (atomic_load_explicit(&(q->tail), memory_order_acquire) != head) queue_wait(&spins);
+}
+
+uint8_t cm_wait_global_pin(cm *machine)
+{
+  cm_fence(machine);
+  return machine->globalPin;
+}
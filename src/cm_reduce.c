@@ -0,0 +1,276 @@
+#include "connection_machine.h"
+#include "cm_trace.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Host side reductions over the cell state. The machine itself only gives back the global pin, a single
+ * OR, so anything like a count or a sum takes a log depth program on the cells. These instead look at the
+ * cells directly, which is what you want for convergence checks and for validating results.
+ *
+ * A bit of memory is the same bit of the same byte in every cell's copy of its page, and the pages of a
+ * plane sit one after another, so counting one is a walk down a column of bytes in machine memory. Eight
+ * cells' bytes go into a 64 bit word and the bit is counted in all of them with one popcount. Pages that
+ * have never been written are all zeros, so they need no checking. Flags live in each cell's own struct,
+ * so they do still have to be picked up a cell at a time, but as whole 16 bit words, four to a 64 bit word,
+ * counted or searched with one popcount or ctz. Fields can cross pages, so cm_reduce_field is a plain
+ * walk over the cells.
+ *
+ * Chips are independent, so the loops split over threads when built with OpenMP. Like every other host
+ * read they wait for submitted instructions first.
+ */
+
+_Static_assert((1 << PROCESSORS) % 4 == 0, "chips' flags are taken four cells at a time");
+
+/* Flag f is bit 15 - f of each cell's flags, so that bit of each 16 bit quarter */
+#define FLAG_LANES(flag) (0x0001000100010001ULL << (15 - (flag)))
+
+/* The flags of cells j to j + 3 of a chip, cell j in the bottom quarter */
+static inline uint64_t chip_flag_word(Chip *c, uint32_t j)
+{
+  return (uint64_t)c->cells[j]->flags | (uint64_t)c->cells[j+1]->flags << 16
+       | (uint64_t)c->cells[j+2]->flags << 32 | (uint64_t)c->cells[j+3]->flags << 48;
+}
+
+/* The counts return -1 for a flag or bit that doesn't exist */
+int32_t cm_count_flag(cm *machine, uint8_t flag)
+{
+  if (flag > 15) return -1;
+  uint64_t total = 0, lanes = FLAG_LANES(flag);
+  int32_t i;
+  cm_fence(machine);
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+:total)
+#endif
+  for (i = 0; i < (1 << DIMENSIONS); i++)
+  {
+    uint32_t j;
+    for (j = 0; j < (1 << PROCESSORS); j += 4)
+    {
+      total += __builtin_popcountll(chip_flag_word(machine->chips[i], j) & lanes);
+    }
+  }
+  return total;
+}
+
+int32_t cm_count_bit(cm *machine, uint16_t addr)
+{
+  if (addr >= CELL_BITS) return -1;
+  uint64_t total = 0, lanes = 0x0101010101010101ULL << (7 - (addr & 7));
+  int32_t k;
+  cm_fence(machine);
+  const uint8_t *column = machine->memory + (size_t)(addr / PAGE_BITS) * PLANE_BYTES + (addr % PAGE_BITS) / 8;
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+:total)
+#endif
+  for (k = 0; k < (1 << (DIMENSIONS + PROCESSORS)); k += 8)
+  {
+    const uint8_t *b = column + (size_t)k * PAGE_BYTES;
+    uint64_t word = 0;
+    uint32_t m;
+    for (m = 0; m < 8; m++) word |= (uint64_t)b[m * PAGE_BYTES] << (m * 8);
+    total += __builtin_popcountll(word & lanes);
+  }
+  return total;
+}
+
+/* Sums wrap around at 64 bits, which only matters for fields wider than 48 bits. Returns 0 with the
+ * answer in result, or -1 if the field or op make no sense.
+ */
+int cm_reduce_field(cm *machine, uint16_t addr, uint8_t len, uint8_t op, uint64_t *result)
+{
+  uint64_t sum = 0, min = UINT64_MAX, max = 0;
+  int32_t i;
+  if (len == 0 || len > 64 || (uint32_t)addr + len > CELL_BITS || op > REDUCE_MAX) return -1;
+  cm_fence(machine);
+#ifdef _OPENMP
+#pragma omp parallel for reduction(+:sum) reduction(min:min) reduction(max:max)
+#endif
+  for (i = 0; i < (1 << DIMENSIONS); i++)
+  {
+    uint32_t j;
+    for (j = 0; j < (1 << PROCESSORS); j++)
+    {
+      uint64_t v = cell_read_field(machine->chips[i]->cells[j], addr, len);
+      sum += v;
+      if (v < min) min = v;
+      if (v > max) max = v;
+    }
+  }
+  if (op == REDUCE_MIN) *result = min;
+  else if (op == REDUCE_MAX) *result = max;
+  else *result = sum;
+  return 0;
+}
+
+/* The first cell in machine order (chip by chip, then cell by cell) with the flag set, or -1 if none
+ * does or there's no such flag
+ */
+int32_t cm_find_first(cm *machine, uint8_t flag)
+{
+  if (flag > 15) return -1;
+  uint64_t lanes = FLAG_LANES(flag);
+  uint32_t i, j;
+  cm_fence(machine);
+  for (i = 0; i < (1 << DIMENSIONS); i++)
+  {
+    for (j = 0; j < (1 << PROCESSORS); j += 4)
+    {
+      uint64_t word = chip_flag_word(machine->chips[i], j) & lanes;
+      if (word) return (i << PROCESSORS) + j + (__builtin_ctzll(word) >> 4);
+    }
+  }
+  return -1;
+}
+
+/* Scans. The daisy chain passes a running OR, XOR or sum on from cell to cell, but across the whole machine
+ * that takes an instruction per cell. These give exactly what running the chain serially in machine order
+ * would, but as a parallel prefix over the chips: each chip reduces its own cells to a summary, the
+ * summaries are scanned in log depth to find what carries into each chip, and then each chip runs its own
+ * cells again from there.
+ *
+ * With a segment flag, every cell that has it set starts the running value again from nothing, so a chip's
+ * summary is what it's gathered since its last segment start and whether it had one. Flag 0 is never set,
+ * so it means no segments.
+ */
+
+typedef struct
+{
+  uint64_t value;
+  uint8_t reset;
+} scan_summary;
+
+static uint64_t scan_op(uint8_t op, uint64_t a, uint64_t b)
+{
+  if (op == SCAN_OR) return a | b;
+  if (op == SCAN_XOR) return a ^ b;
+  return a + b;
+}
+
+/* A summary followed by another. A segment start in the second cuts off everything in the first. */
+static scan_summary scan_combine(uint8_t op, scan_summary a, scan_summary b)
+{
+  if (b.reset) return b;
+  b.value = scan_op(op, a.value, b.value);
+  b.reset = a.reset;
+  return b;
+}
+
+/* Blelloch's scan, turning each chip's summary into what comes before it. Up the tree, each node ends up
+ * holding the summary of its left subtree and itself; down again, each left child takes what came before
+ * its parent and each right child that plus the left child's summary. Each level's nodes are independent.
+ */
+static void scan_chips(scan_summary *chips, uint8_t op)
+{
+  const int32_t n = 1 << DIMENSIONS;
+  int32_t d, k;
+  for (d = 1; d < n; d <<= 1)
+  {
+#ifdef _OPENMP
+#pragma omp parallel for if (n / (2 * d) >= 64)
+#endif
+    for (k = 2 * d - 1; k < n; k += 2 * d) chips[k] = scan_combine(op, chips[k - d], chips[k]);
+  }
+  chips[n - 1].value = 0;
+  chips[n - 1].reset = 0;
+  for (d = n >> 1; d >= 1; d >>= 1)
+  {
+#ifdef _OPENMP
+#pragma omp parallel for if (n / (2 * d) >= 64)
+#endif
+    for (k = 2 * d - 1; k < n; k += 2 * d)
+    {
+      scan_summary left = chips[k - d];
+      chips[k - d] = chips[k];
+      chips[k] = scan_combine(op, chips[k], left);
+    }
+  }
+}
+
+static int cm_scan(cm *machine, uint8_t fromFlag, uint16_t src, uint16_t dst, uint8_t len, uint8_t op,
+                   uint8_t segment)
+{
+  uint8_t kind = op & ~SCAN_EXCLUSIVE;
+  if (len == 0 || len > 64 || kind > SCAN_SUM || op > (SCAN_SUM | SCAN_EXCLUSIVE) || segment > 15
+      || (fromFlag && src > 15) || (!fromFlag && (uint32_t)src + len > CELL_BITS)
+      || (uint32_t)dst + len > CELL_BITS) return -1;
+  cm_fence(machine);
+
+  uint64_t *values = (uint64_t *)malloc(sizeof(uint64_t) << (DIMENSIONS + PROCESSORS));
+  scan_summary *chips = (scan_summary *)malloc(sizeof(scan_summary) << DIMENSIONS);
+  uint16_t segmentBit = segment ? 1 << (15 - segment) : 0;
+  int32_t i;
+
+  /* Every chip's own cells, keeping the values to save reading them again */
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (i = 0; i < (1 << DIMENSIONS); i++)
+  {
+    uint64_t *v = values + (i << PROCESSORS);
+    scan_summary sum = {0, 0};
+    uint32_t j;
+    for (j = 0; j < (1 << PROCESSORS); j++)
+    {
+      Cell *c = machine->chips[i]->cells[j];
+      v[j] = fromFlag ? (c->flags >> (15 - src)) & 1 : cell_read_field(c, src, len);
+      if (c->flags & segmentBit)
+      {
+        sum.value = 0;
+        sum.reset = 1;
+      }
+      sum.value = scan_op(kind, sum.value, v[j]);
+    }
+    chips[i] = sum;
+  }
+
+  scan_chips(chips, kind);
+
+  /* Then every chip again, from what comes before it. The writes only touch dst, so cells further on
+   * still see what they started with, as they would in the chain.
+   */
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (i = 0; i < (1 << DIMENSIONS); i++)
+  {
+    uint64_t *v = values + (i << PROCESSORS);
+    uint64_t running = chips[i].value;
+    uint32_t j;
+    for (j = 0; j < (1 << PROCESSORS); j++)
+    {
+      Cell *c = machine->chips[i]->cells[j];
+      if (c->flags & segmentBit) running = 0;
+      uint64_t before = running;
+      running = scan_op(kind, running, v[j]);
+      cell_write_field(c, dst, len, (op & SCAN_EXCLUSIVE) ? before : running);
+    }
+  }
+
+  free(values);
+  free(chips);
+  if (RECORDING(machine))
+  {
+    cm_trace_record(machine, TRACE_SCAN, ((uint64_t)src << 40) | ((uint64_t)dst << 24) | (segment << 16)
+                                         | ((uint32_t)len << 8) | op | (fromFlag ? SCAN_FLAG : 0));
+  }
+  return 0;
+}
+
+int cm_scan_flag(cm *machine, uint8_t flag, uint16_t dst, uint8_t len, uint8_t op, uint8_t segment)
+{
+  return cm_scan(machine, 1, flag, dst, len, op, segment);
+}
+
+int cm_scan_field(cm *machine, uint16_t src, uint16_t dst, uint8_t len, uint8_t op, uint8_t segment)
+{
+  return cm_scan(machine, 0, src, dst, len, op, segment);
+}
+
+/* Numbers the cells with the flag set from 0 in machine order, which is where each would go if they were
+ * packed together. Returns how many there are, or -1 if the scan would be rejected.
+ */
+int32_t cm_enumerate(cm *machine, uint8_t flag, uint16_t dst, uint8_t len)
+{
+  if (cm_scan_flag(machine, flag, dst, len, SCAN_SUM | SCAN_EXCLUSIVE, 0)) return -1;
+  return cm_count_flag(machine, flag);
+}
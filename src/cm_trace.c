@@ -0,0 +1,193 @@
+#include "cm_trace.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Recording and replay of everything done to a machine. Host programs interleave a lot of C with their
+ * calls to cm_exe, so rerunning an experiment means rerunning the whole driver. A trace keeps just the
+ * instructions (in the same packed format as dumps), mode changes and host writes, so it can be rerun
+ * later with nothing in between, and checked against the state hash taken at the end of the recording.
+ */
+
+void cm_trace_record(cm *machine, uint8_t type, uint64_t payload)
+{
+  uint64_t record = payload;
+  if (type != TRACE_DATA) record = ((uint64_t)type << 56) | (payload & ((1ULL << 56) - 1));
+  if (machine->trace) fwrite(&record, sizeof(uint64_t), 1, machine->trace);
+  if (machine->history) cm_history_record(machine, record);
+}
+
+void cm_trace_mode(cm *machine)
+{
+  cm_trace_record(machine, TRACE_MODE, machine->shouldOr | (machine->slowMode << 8)
+                                       | ((uint32_t)machine->combine << 16)
+                                       | ((uint32_t)machine->newsWrap << 24)
+                                       | ((uint64_t)machine->cube << 32));
+}
+
+/* FNV-1a over the cells, the routers and the petit counter. Messages are hashed by value, as their
+ * addresses in the host heap will differ from run to run.
+ */
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t len)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  size_t i;
+  for (i = 0; i < len; i++)
+  {
+    h ^= p[i];
+    h *= 0x100000001B3ULL;
+  }
+  return h;
+}
+
+/* Pages that were never written hash the same as if they were there and full of zeros */
+static uint64_t hash_memory(uint64_t h, Cell *c)
+{
+  uint32_t p, b;
+  for (p = 0; p < CELL_PAGES; p++)
+  {
+    if ((c->live >> p) & 1) h = hash_bytes(h, c->home + p * PLANE_BYTES, PAGE_BYTES);
+    else for (b = 0; b < PAGE_BYTES; b++) h *= 0x100000001B3ULL;
+  }
+  return h;
+}
+
+static uint64_t hash_message(uint64_t h, Message *m)
+{
+  if (m == NULL) return hash_bytes(h, "-", 1);
+  h = hash_bytes(h, &(m->address), sizeof(uint32_t));
+  h = hash_bytes(h, m->message, MESSAGE_LENGTH);
+  return hash_bytes(h, &(m->parity), 1);
+}
+
+uint64_t cm_hash(cm *machine)
+{
+  uint64_t h = 0xCBF29CE484222325ULL;
+  uint32_t i, j;
+  cm_fence(machine);
+  for (i = 0; i < (1 << DIMENSIONS); i++)
+  {
+    Chip *c = machine->chips[i];
+    for (j = 0; j < (1 << PROCESSORS); j++)
+    {
+      h = hash_bytes(h, &(c->cells[j]->flags), sizeof(uint16_t));
+      h = hash_memory(h, c->cells[j]);
+    }
+    for (j = 0; j < BUFSIZE; j++) h = hash_message(h, c->router->buffer[j]);
+    for (j = 0; j < DIMENSIONS; j++) h = hash_message(h, c->router->inports[j]);
+    for (j = 0; j < 4; j++) h = hash_message(h, c->router->partials[j]);
+    h = hash_bytes(h, c->router->listening, sizeof(c->router->listening));
+  }
+  h = hash_bytes(h, &(machine->petitCounter), sizeof(uint32_t));
+  return hash_bytes(h, &(machine->globalPin), 1);
+}
+
+/* Tracing has to start on a fresh machine, before any instructions have run, as the trace doesn't hold
+ * the starting state. Host writes should then go through cm_write_field and cm_write_flag so they are
+ * recorded. Returns 0 on success, -1 if the machine has already run or the file can't be opened.
+ */
+int cm_trace_start(cm *machine, const char *fileName)
+{
+  if (machine->cycle || machine->trace) return -1;
+  machine->trace = fopen(fileName, "wb");
+  if (machine->trace == NULL) return -1;
+
+  uint64_t magic = TRACE_MAGIC;
+  fwrite(&magic, sizeof(uint64_t), 1, machine->trace);
+  cm_trace_mode(machine);
+  return 0;
+}
+
+/* Finishing a trace records the cycle count and state hash for replays to check against */
+int cm_trace_stop(cm *machine)
+{
+  if (machine->trace == NULL) return -1;
+  cm_trace_record(machine, TRACE_END, machine->cycle);
+  cm_trace_record(machine, TRACE_DATA, cm_hash(machine));
+  fclose(machine->trace);
+  machine->trace = NULL;
+  return 0;
+}
+
+/* Runs records onto a machine, starting from record i, and stops at a TRACE_END or once the machine has
+ * got to cycle `until` and the next record is an instruction. Returns the index of the record it stopped
+ * at, or n if it ran out.
+ */
+size_t cm_trace_apply(cm *machine, const uint64_t *records, size_t n, size_t i, uint32_t until)
+{
+  for (; i < n; i++)
+  {
+    uint64_t payload = records[i] & ((1ULL << 56) - 1);
+    uint8_t type = records[i] >> 56;
+    if (type == TRACE_END || (type == TRACE_INS && machine->cycle == until)) break;
+    switch (type)
+    {
+      case TRACE_INS:
+#if ADDR_BITS > 12
+        if (++i == n) break;
+        payload = records[i];
+#endif
+        cm_exe_packed(machine, payload);
+        break;
+      case TRACE_MODE:
+        /* These were checked for synchronisation when they were recorded */
+        machine->shouldOr = payload & 0xFF;
+        machine->slowMode = (payload >> 8) & 0xFF;
+        machine->combine = (payload >> 16) & 0xFF;
+        machine->newsWrap = (payload >> 24) & 0xFF;
+        machine->cube = (payload >> 32) & 0xFF;
+        break;
+      case TRACE_FIELD:
+        if (++i == n) break;
+        cm_write_field(machine, payload >> 24, (payload >> 8) & 0xFFFF, payload & 0xFF, records[i]);
+        break;
+      case TRACE_FLAG:
+        cm_write_flag(machine, payload >> 24, (payload >> 8) & 0xFF, payload & 1);
+        break;
+      case TRACE_SCAN:
+        if (payload & SCAN_FLAG)
+        {
+          cm_scan_flag(machine, payload >> 40, (payload >> 24) & 0xFFFF, (payload >> 8) & 0xFF,
+                       payload & (SCAN_FLAG - 1), (payload >> 16) & 0xFF);
+        }
+        else
+        {
+          cm_scan_field(machine, payload >> 40, (payload >> 24) & 0xFFFF, (payload >> 8) & 0xFF,
+                        payload & (SCAN_FLAG - 1), (payload >> 16) & 0xFF);
+        }
+        break;
+    }
+  }
+  return i;
+}
+
+/* Replays a trace onto a freshly built machine. The whole file is read up front so the loop does nothing
+ * but decode records and run them. Returns 0 if the final state matches the recording, 1 if it doesn't,
+ * and -1 if the file can't be read or isn't a complete trace.
+ */
+int cm_replay(cm *machine, const char *fileName)
+{
+  FILE *f = fopen(fileName, "rb");
+  if (f == NULL) return -1;
+  fseek(f, 0, SEEK_END);
+  size_t n = ftell(f) / sizeof(uint64_t);
+  fseek(f, 0, SEEK_SET);
+  uint64_t *records = (uint64_t *)malloc(n * sizeof(uint64_t));
+  if (fread(records, sizeof(uint64_t), n, f) != n || n < 1 || records[0] != TRACE_MAGIC)
+  {
+    fclose(f);
+    free(records);
+    return -1;
+  }
+  fclose(f);
+
+  int result = -1;
+  size_t i = cm_trace_apply(machine, records, n, 1, UINT32_MAX);
+  if (i + 1 < n && (records[i] >> 56) == TRACE_END)
+  {
+    uint64_t cycles = records[i] & ((1ULL << 56) - 1);
+    result = (machine->cycle == cycles && cm_hash(machine) == records[i + 1]) ? 0 : 1;
+  }
+  free(records);
+  return result;
+}
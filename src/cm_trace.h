@@ -0,0 +1,48 @@
+#ifndef CM_TRACE_H_
+#define CM_TRACE_H_
+
+#include "connection_machine.h"
+
+/* A trace is the magic word below followed by a stream of 64 bit records. The top byte of each record
+ * is its type and the rest is the payload:
+ *
+ *   TRACE_INS    an instruction in the packed format from cm_pack. With CELL_BITS raised the addresses
+ *                are too wide for it to fit, so it's left out and follows in a TRACE_DATA record instead
+ *   TRACE_MODE   shouldOr in bits 0-7, slowMode in bits 8-15, combine in bits 16-23, newsWrap in bits
+ *                24-31 and cube in bits 32-39
+ *   TRACE_FIELD  a host field write, cell in bits 24-47, addr in bits 8-23 and len in bits 0-7. The
+ *                value follows in a TRACE_DATA record
+ *   TRACE_FLAG   a host flag write, cell in bits 24-47, flag in bits 8-15 and the value in bit 0
+ *   TRACE_END    the number of cycles run, followed by the state hash in a TRACE_DATA record
+ *   TRACE_SCAN   a host scan, op in bits 0-7 (with SCAN_FLAG set when scanning a flag), len in bits 8-15,
+ *                the segment flag in bits 16-23, dst in bits 24-39 and src in bits 40-55
+ *
+ * TRACE_DATA records carry a full 64 bit word with no type byte, and only ever follow one of the above.
+ */
+
+#define TRACE_MAGIC 0x31454341525443ULL /* "CTRACE1" */
+
+#define TRACE_INS 0
+#define TRACE_MODE 1
+#define TRACE_FIELD 2
+#define TRACE_FLAG 3
+#define TRACE_END 4
+#define TRACE_SCAN 5
+#define TRACE_DATA 0xFF
+
+#define SCAN_FLAG 8
+
+/* Records go to the trace and the history log, whichever are being kept */
+#define RECORDING(machine) ((machine)->trace || (machine)->history)
+
+void cm_trace_record(cm *machine, uint8_t type, uint64_t payload);
+
+void cm_trace_mode(cm *machine);
+
+size_t cm_trace_apply(cm *machine, const uint64_t *records, size_t n, size_t i, uint32_t until);
+
+void cm_history_record(cm *machine, uint64_t record);
+
+void cm_history_step(cm *machine);
+
+#endif
@@ -0,0 +1,303 @@
+#include "connection_machine.h"
+#include "cm_trigger.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Dumping every cycle gives everything, but at tens of megabytes a cycle it's only any good for very
+ * short runs. Usually only a handful of cycles around something going wrong actually matter, so this
+ * lets the host say what it's looking for and only write out a full dump when it happens.
+ *
+ * Every cycle the machine records a frame, which is just the instruction and a few counters, into a ring
+ * of the last few. Watches are checked after each cycle, and when one fires the machine is dumped and the
+ * frames leading up to it are written alongside. Observers are callbacks run after each cycle, or only
+ * on cycles where a watch fired.
+ *
+ * None of this exists until the host asks for it. A machine without an observer only ever checks that
+ * the pointer is NULL in cm_exe.
+ */
+
+#define WATCH_FIELD 0
+#define WATCH_FLAG 1
+#define WATCH_ROUTER 2
+#define WATCH_CYCLES 3
+
+typedef struct
+{
+  uint8_t type;
+  uint32_t firstCell;
+  uint32_t lastCell;
+  uint16_t addr; /* Or the flag, or the router event */
+  uint8_t len;
+  uint32_t firstCycle; /* Only checked on cycles in this window */
+  uint32_t lastCycle;
+  uint8_t stale; /* Has been outside its window, so old holds nothing useful */
+  uint64_t *old; /* What each watched cell held last time */
+} cm_watch;
+
+struct cm_observer
+{
+  cm_watch watches[WATCH_MAX];
+  uint32_t watchCount;
+  cm_frame *ring;
+  uint32_t ringSize;
+  uint32_t ringNext; /* Frames recorded ever, so the next slot is this mod ringSize */
+  uint32_t ringSaved; /* Value of ringNext at the last capture */
+  char *fileName;
+  cm_observer_fn fn;
+  void *user;
+  uint8_t everyCycle;
+};
+
+static struct cm_observer *observer_get(cm *machine)
+{
+  cm_fence(machine);
+  if (machine->observer == NULL)
+  {
+    machine->observer = (struct cm_observer *)calloc(1, sizeof(struct cm_observer));
+  }
+  return machine->observer;
+}
+
+/* Router events are counted by every router separately, so the machine's count is their sum */
+static void observer_counts(cm *machine, uint32_t *referred, uint32_t *parityFailed)
+{
+  uint32_t i;
+  *referred = 0;
+  *parityFailed = 0;
+  for (i = 0; i < (1 << DIMENSIONS); i++)
+  {
+    *referred += machine->chips[i]->router->referred;
+    *parityFailed += machine->chips[i]->router->parityFailed;
+  }
+}
+
+static uint64_t watch_value(cm *machine, cm_watch *w, uint32_t cell)
+{
+  Cell *c = machine->chips[cell >> PROCESSORS]->cells[cell & ((1 << PROCESSORS) - 1)];
+  if (w->type == WATCH_FIELD) return cell_read_field(c, w->addr, w->len);
+  return (c->flags >> (15 - w->addr)) & 1;
+}
+
+/* Takes a fresh copy of what a watch is looking at, so that only changes from here on fire it */
+static void watch_snapshot(cm *machine, cm_watch *w)
+{
+  uint32_t cell;
+  if (w->type == WATCH_ROUTER)
+  {
+    uint32_t referred, parityFailed;
+    observer_counts(machine, &referred, &parityFailed);
+    w->old[0] = (w->addr == ROUTER_EVENT_REFER) ? referred : parityFailed;
+  }
+  else if (w->type != WATCH_CYCLES)
+  {
+    for (cell = w->firstCell; cell <= w->lastCell; cell++)
+    {
+      w->old[cell - w->firstCell] = watch_value(machine, w, cell);
+    }
+  }
+  w->stale = 0;
+}
+
+static int watch_add(cm *machine, uint8_t type, uint32_t firstCell, uint32_t lastCell, uint16_t addr,
+                     uint8_t len)
+{
+  struct cm_observer *o = observer_get(machine);
+  if (o->watchCount == WATCH_MAX) return -1;
+
+  cm_watch *w = &(o->watches[o->watchCount]);
+  w->type = type;
+  w->firstCell = firstCell;
+  w->lastCell = lastCell;
+  w->addr = addr;
+  w->len = len;
+  w->firstCycle = 0;
+  w->lastCycle = UINT32_MAX;
+  w->old = (uint64_t *)calloc(lastCell - firstCell + 1, sizeof(uint64_t));
+  watch_snapshot(machine, w);
+  return o->watchCount++;
+}
+
+/* Fires when the len bit field at addr changes in any cell from firstCell to lastCell */
+int cm_watch_field(cm *machine, uint32_t firstCell, uint32_t lastCell, uint16_t addr, uint8_t len)
+{
+  if (firstCell > lastCell || lastCell >= (1 << (DIMENSIONS + PROCESSORS)) || len == 0 || len > 64
+      || addr + len > CELL_BITS) return -1;
+  return watch_add(machine, WATCH_FIELD, firstCell, lastCell, addr, len);
+}
+
+/* Fires when flag changes in any cell from firstCell to lastCell */
+int cm_watch_flag(cm *machine, uint32_t firstCell, uint32_t lastCell, uint8_t flag)
+{
+  if (firstCell > lastCell || lastCell >= (1 << (DIMENSIONS + PROCESSORS)) || flag > 15) return -1;
+  return watch_add(machine, WATCH_FLAG, firstCell, lastCell, flag, 1);
+}
+
+/* Fires on any cycle where a router anywhere refers a message or throws one away for bad parity */
+int cm_watch_router(cm *machine, uint8_t event)
+{
+  if (event > ROUTER_EVENT_PARITY) return -1;
+  return watch_add(machine, WATCH_ROUTER, 0, 0, event, 0);
+}
+
+/* Fires on every cycle from first to last, counted as in machine->cycle */
+int cm_watch_cycles(cm *machine, uint32_t first, uint32_t last)
+{
+  if (first > last) return -1;
+  int id = watch_add(machine, WATCH_CYCLES, 0, 0, 0, 0);
+  if (id >= 0) cm_watch_window(machine, id, first, last);
+  return id;
+}
+
+/* Limits a watch to cycles from first to last. Changes made outside the window are ignored. If the next
+ * cycle is already in the window, what the cells hold now is what it gets compared against.
+ */
+uint8_t cm_watch_window(cm *machine, int id, uint32_t first, uint32_t last)
+{
+  struct cm_observer *o = observer_get(machine);
+  if (id < 0 || (uint32_t)id >= o->watchCount || first > last) return -1;
+  cm_watch *w = &(o->watches[id]);
+  w->firstCycle = first;
+  w->lastCycle = last;
+  if (machine->cycle >= first && machine->cycle <= last) watch_snapshot(machine, w);
+  else w->stale = 1;
+  return 0;
+}
+
+/* Keeps the last frames cycles in memory, and writes a capture to fileName whenever a watch fires.
+ * fileName can be NULL to just keep the ring for observers.
+ */
+int cm_capture(cm *machine, const char *fileName, uint32_t frames)
+{
+  struct cm_observer *o = observer_get(machine);
+  if (frames == 0) return -1;
+  free(o->ring);
+  free(o->fileName);
+  o->ring = (cm_frame *)calloc(frames, sizeof(cm_frame));
+  o->ringSize = frames;
+  o->ringNext = 0;
+  o->ringSaved = 0;
+  o->fileName = fileName ? strdup(fileName) : NULL;
+  return 0;
+}
+
+void cm_observe(cm *machine, cm_observer_fn fn, void *user, uint8_t everyCycle)
+{
+  struct cm_observer *o = observer_get(machine);
+  o->fn = fn;
+  o->user = user;
+  o->everyCycle = everyCycle;
+}
+
+/* Copies the most recent frames, up to max of them, into out, oldest first. Returns how many. */
+uint32_t cm_frames(cm *machine, cm_frame *out, uint32_t max)
+{
+  struct cm_observer *o = machine->observer;
+  cm_fence(machine);
+  if (o == NULL || o->ring == NULL) return 0;
+  uint32_t n = (o->ringNext < o->ringSize) ? o->ringNext : o->ringSize;
+  if (n > max) n = max;
+  uint32_t i;
+  for (i = 0; i < n; i++) out[i] = o->ring[(o->ringNext - n + i) % o->ringSize];
+  return n;
+}
+
+/* Removes every watch, the ring and the observer, leaving the machine as if none had been set up */
+void cm_observer_del(cm *machine)
+{
+  cm_fence(machine);
+  struct cm_observer *o = machine->observer;
+  if (o == NULL) return;
+  uint32_t i;
+  for (i = 0; i < o->watchCount; i++) free(o->watches[i].old);
+  free(o->ring);
+  free(o->fileName);
+  free(o);
+  machine->observer = NULL;
+}
+
+static uint8_t watch_check(cm *machine, cm_watch *w, cm_frame *f)
+{
+  if (f->cycle < w->firstCycle || f->cycle > w->lastCycle)
+  {
+    /* Just before the window opens, take what the first cycle in it will be compared against */
+    if (f->cycle + 1 == w->firstCycle) watch_snapshot(machine, w);
+    else w->stale = 1;
+    return 0;
+  }
+  if (w->type == WATCH_CYCLES) return 1;
+  if (w->stale)
+  {
+    watch_snapshot(machine, w);
+    return 0;
+  }
+
+  if (w->type == WATCH_ROUTER)
+  {
+    uint32_t now = (w->addr == ROUTER_EVENT_REFER) ? f->referred : f->parityFailed;
+    uint8_t fired = now != w->old[0];
+    w->old[0] = now;
+    return fired;
+  }
+
+  uint8_t fired = 0;
+  uint32_t cell;
+  for (cell = w->firstCell; cell <= w->lastCell; cell++)
+  {
+    uint64_t now = watch_value(machine, w, cell);
+    if (now != w->old[cell - w->firstCell]) fired = 1;
+    w->old[cell - w->firstCell] = now;
+  }
+  return fired;
+}
+
+/* Writes the frames since the last capture in with the dump. Like cm_dump, the file is added to the
+ * archive and then removed.
+ */
+static void observer_save(cm *machine, struct cm_observer *o, uint64_t ins, uint32_t cycle)
+{
+  cm_dump(machine, cycle, ins, o->fileName);
+
+  char ringName[20];
+  sprintf(ringName, "ring%u", cycle);
+  FILE *ring = fopen(ringName, "w");
+  if (ring == NULL) return;
+  uint32_t n = o->ringNext - o->ringSaved, i;
+  if (n > o->ringSize) n = o->ringSize;
+  for (i = 0; i < n; i++) fwrite(&(o->ring[(o->ringNext - n + i) % o->ringSize]), sizeof(cm_frame), 1, ring);
+  fclose(ring);
+  o->ringSaved = o->ringNext;
+
+  char command[128 + strlen(o->fileName)];
+  sprintf(command, "zip -9u %s %s", o->fileName, ringName);
+  system(command);
+  remove(ringName);
+}
+
+/* Called by cm_exe at the end of every cycle while an observer is set up */
+void cm_observer_step(cm *machine, uint64_t ins)
+{
+  struct cm_observer *o = machine->observer;
+  cm_frame f;
+  uint32_t i;
+
+  f.cycle = machine->cycle;
+  f.petitCounter = machine->petitCounter;
+  f.ins = ins;
+  observer_counts(machine, &(f.referred), &(f.parityFailed));
+  f.globalPin = machine->globalPin;
+  f.fired = 0;
+  for (i = 0; i < o->watchCount; i++)
+  {
+    if (watch_check(machine, &(o->watches[i]), &f)) f.fired |= 1U << i;
+  }
+
+  if (o->ring)
+  {
+    o->ring[o->ringNext % o->ringSize] = f;
+    o->ringNext++;
+    if (f.fired && o->fileName) observer_save(machine, o, ins, f.cycle);
+  }
+  if (o->fn && (f.fired || o->everyCycle)) o->fn(machine, &f, o->user);
+}
@@ -0,0 +1,18 @@
+#ifndef CM_TRIGGER_H_
+#define CM_TRIGGER_H_
+
+#include "connection_machine.h"
+
+/* Captures are zip archives, like dumps. Each time a watch fires, two entries are added: a full dump
+ * of the machine named after the cycle, in the format written by cm_dump, and "ring" followed by the
+ * cycle, which holds the cm_frame records for the cycles since the previous capture (up to the size of
+ * the ring), oldest first, exactly as laid out in memory.
+ */
+
+#define WATCH_MAX 32
+
+void cm_observer_step(cm *machine, uint64_t ins);
+
+void cm_dump(cm *machine, uint32_t count, uint64_t ins, const char *fileName);
+
+#endif
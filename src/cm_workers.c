@@ -0,0 +1,477 @@
+#define _GNU_SOURCE
+#include "cm_workers.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/* Running the chips on several threads. Each worker owns a contiguous range of chips, which (with a
+ * power of 2 of workers) is a sub-cube of the hypercube, so only the wires of the top few dimensions
+ * run between workers. Workers are pinned to processors spread over the host's NUMA nodes in order, so
+ * neighbouring workers share a node and it's only the very top dimensions whose wires cross sockets.
+ *
+ * To keep each worker's chips close to it, the worker builds fresh copies of its Chip, Cell and Router
+ * structures once it's pinned, so they're first touched on its own node, and asks for its stretch of
+ * every memory plane to be placed there too. Memory pages are still only made when they're written, so
+ * the placement just tells the kernel where to put them when they are.
+ *
+ * cm_exe runs in two halves either side of the NEWS grid, which is still driven by the calling thread.
+ * Running the chips and routers is all local to each chip, except forwarding, which only ever writes the
+ * inport of the chip at the other end of the wire, and nothing reads inports until receiving. Receiving
+ * is local too, unless a router's buffer is full and it has to refer the message to the next chip,
+ * which could be running on another worker. Before each receive the machine checks whether any full
+ * router has a message waiting, and if so receives on the calling thread instead, in chip order, so
+ * the result is exactly what a single thread would get.
+ *
+ * Talking to the kernel is done with plain system calls, so there's no need to link against libnuma.
+ */
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+
+#define NODES_MAX 64
+#define PLACEMENT_BATCH 512
+
+#define WORK_HOME 0
+#define WORK_EXE 1
+#define WORK_RECV 2
+#define WORK_STOP 3
+
+struct cm_worker
+{
+  cm *machine;
+  pthread_t thread;
+  uint32_t first, last; /* Chips first to last - 1 */
+  int cpu;
+  int node;
+};
+
+struct cm_workers
+{
+  uint32_t count;
+  struct cm_worker *workers;
+  pthread_barrier_t go, done;
+  pthread_mutex_t lock;
+  pthread_cond_t started;
+  uint8_t ready; /* 1 once every worker has started, 2 if some couldn't be */
+  uint8_t work;
+  uint8_t recv; /* Workers receive as well as doing the cube exchange */
+  uint16_t addrA, addrB;
+  uint8_t flagR, flagW, flagC, sense, memTruth, flagTruth;
+};
+
+/* Reads a sysfs cpulist, such as "0-3,8-11", into cpus. Returns how many were added */
+static uint32_t workers_cpulist(const char *fileName, int *cpus, int *nodes, int node, uint32_t room)
+{
+  FILE *f = fopen(fileName, "r");
+  if (f == NULL) return 0;
+  uint32_t n = 0;
+  int first, last;
+  char sep;
+  while (fscanf(f, "%d", &first) == 1)
+  {
+    last = first;
+    if (fscanf(f, "%c", &sep) == 1 && sep == '-')
+    {
+      if (fscanf(f, "%d", &last) != 1) break;
+      if (fscanf(f, "%c", &sep) != 1) sep = 0;
+    }
+    for (; first <= last && n < room; first++)
+    {
+      cpus[n] = first;
+      nodes[n++] = node;
+    }
+    if (sep != ',') break;
+  }
+  fclose(f);
+  return n;
+}
+
+/* Every processor on the host, in node order. Hosts without NUMA information count as a single node */
+static uint32_t workers_cpus(int **cpus, int **nodes)
+{
+  long online = sysconf(_SC_NPROCESSORS_CONF);
+  uint32_t room = online > 0 ? online : 1, n = 0;
+  *cpus = (int *)malloc(room * sizeof(int));
+  *nodes = (int *)malloc(room * sizeof(int));
+
+  char fileName[64];
+  int node;
+  for (node = 0; node < NODES_MAX; node++)
+  {
+    snprintf(fileName, sizeof(fileName), "/sys/devices/system/node/node%d/cpulist", node);
+    n += workers_cpulist(fileName, *cpus + n, *nodes + n, node, room - n);
+  }
+  if (n == 0)
+  {
+    for (n = 0; n < room; n++)
+    {
+      (*cpus)[n] = n;
+      (*nodes)[n] = 0;
+    }
+  }
+  return n;
+}
+
+/* Gives the worker's chips new structures, made from the worker's thread, and points its stretch of each
+ * memory plane at its node. Wiring the chips back together is left to the machine.
+ */
+static void workers_home(struct cm_worker *w)
+{
+  cm *machine = w->machine;
+  uint32_t i, j;
+  for (i = w->first; i < w->last; i++)
+  {
+    Chip *old = machine->chips[i];
+    Chip *c = (Chip *)malloc(sizeof(Chip));
+    memcpy(c, old, sizeof(Chip));
+    c->router = (Router *)malloc(sizeof(Router));
+    memcpy(c->router, old->router, sizeof(Router));
+    for (j = 0; j < (1 << PROCESSORS); j++)
+    {
+      c->cells[j] = (Cell *)malloc(sizeof(Cell));
+      memcpy(c->cells[j], old->cells[j], sizeof(Cell));
+    }
+    chip_del(old);
+    machine->chips[i] = c;
+  }
+
+  if (w->node >= (int)(sizeof(unsigned long) << 3)) return;
+  unsigned long mask = 1UL << w->node;
+  size_t stretch = (size_t)(w->last - w->first) * (1 << PROCESSORS) * PAGE_BYTES;
+  for (j = 0; j < CELL_PAGES; j++)
+  {
+    uint8_t *from = machine->memory + (size_t)j * PLANE_BYTES
+                    + (size_t)w->first * (1 << PROCESSORS) * PAGE_BYTES;
+    /* Not every kernel does NUMA, in which case there's nothing to place */
+    syscall(SYS_mbind, from, stretch, MPOL_PREFERRED, &mask, (sizeof(mask) << 3) + 1, MPOL_MF_MOVE);
+  }
+}
+
+static void *workers_run(void *arg)
+{
+  struct cm_worker *w = (struct cm_worker *)arg;
+  cm *machine = w->machine;
+  struct cm_workers *pool = machine->workers;
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(w->cpu, &set);
+  sched_setaffinity(0, sizeof(set), &set);
+
+  pthread_mutex_lock(&(pool->lock));
+  while (!pool->ready) pthread_cond_wait(&(pool->started), &(pool->lock));
+  pthread_mutex_unlock(&(pool->lock));
+  if (pool->ready != 1) return NULL;
+
+  uint32_t i;
+  while (1)
+  {
+    pthread_barrier_wait(&(pool->go));
+    if (pool->work == WORK_STOP) break;
+    switch (pool->work)
+    {
+      case WORK_HOME:
+        workers_home(w);
+        break;
+      case WORK_EXE:
+        for (i = w->first; i < w->last; i++)
+        {
+          chip_exe(machine->chips[i], pool->addrA, pool->addrB, pool->flagR, pool->flagW, pool->flagC,
+                   pool->sense, pool->memTruth, pool->flagTruth, machine->petitCounter, machine->shouldOr,
+                   machine->slowMode, machine->combine);
+        }
+        break;
+      case WORK_RECV:
+        for (i = w->first; i < w->last; i++)
+        {
+          if (machine->cube) chip_cube(machine->chips[i], machine->cube - 1);
+          if (pool->recv)
+          {
+            chip_recv(machine->chips[i], machine->petitCounter, machine->slowMode, machine->combine);
+          }
+        }
+        break;
+    }
+    pthread_barrier_wait(&(pool->done));
+  }
+  return NULL;
+}
+
+/* Hands work to every worker and waits for them all to finish it */
+static void workers_go(struct cm_workers *pool, uint8_t work)
+{
+  pool->work = work;
+  pthread_barrier_wait(&(pool->go));
+  if (work != WORK_STOP) pthread_barrier_wait(&(pool->done));
+}
+
+static void workers_free(cm *machine)
+{
+  struct cm_workers *pool = machine->workers;
+  pthread_barrier_destroy(&(pool->go));
+  pthread_barrier_destroy(&(pool->done));
+  pthread_mutex_destroy(&(pool->lock));
+  pthread_cond_destroy(&(pool->started));
+  free(pool->workers);
+  free(pool);
+  machine->workers = NULL;
+}
+
+/* Starts count workers. Chips are shared out in whole memory pages, so there can't be more workers than
+ * that allows. Returns 0 on success, or -1 if workers are already running or can't be started.
+ */
+int cm_workers_start(cm *machine, uint32_t count)
+{
+  if (machine->workers || count == 0) return -1;
+  uint32_t align = 1;
+  long pageSize = sysconf(_SC_PAGESIZE);
+  if (pageSize > (1 << PROCESSORS) * PAGE_BYTES) align = pageSize / ((1 << PROCESSORS) * PAGE_BYTES);
+  uint32_t units = (1 << DIMENSIONS) / align;
+  if (units == 0) units = 1;
+  if (count > units) return -1;
+  cm_fence(machine);
+
+  struct cm_workers *pool = (struct cm_workers *)calloc(1, sizeof(struct cm_workers));
+  pool->count = count;
+  pool->workers = (struct cm_worker *)calloc(count, sizeof(struct cm_worker));
+  pthread_barrier_init(&(pool->go), NULL, count + 1);
+  pthread_barrier_init(&(pool->done), NULL, count + 1);
+  pthread_mutex_init(&(pool->lock), NULL);
+  pthread_cond_init(&(pool->started), NULL);
+
+  /* Workers are spread evenly over the processors, which are in node order */
+  int *cpus, *nodes;
+  uint32_t cpuCount = workers_cpus(&cpus, &nodes), i;
+  for (i = 0; i < count; i++)
+  {
+    struct cm_worker *w = pool->workers + i;
+    w->machine = machine;
+    w->first = (uint32_t)((uint64_t)i * units / count) * align;
+    w->last = i == count - 1 ? (1 << DIMENSIONS) : (uint32_t)((uint64_t)(i + 1) * units / count) * align;
+    w->cpu = cpus[(uint64_t)i * cpuCount / count];
+    w->node = nodes[(uint64_t)i * cpuCount / count];
+  }
+  free(cpus);
+  free(nodes);
+
+  machine->workers = pool;
+  for (i = 0; i < count; i++)
+  {
+    if (pthread_create(&(pool->workers[i].thread), NULL, workers_run, pool->workers + i)) break;
+  }
+  pthread_mutex_lock(&(pool->lock));
+  pool->ready = i < count ? 2 : 1;
+  pthread_cond_broadcast(&(pool->started));
+  pthread_mutex_unlock(&(pool->lock));
+  if (i < count)
+  {
+    /* The ones that did start give up without going near the barriers */
+    uint32_t j;
+    for (j = 0; j < i; j++) pthread_join(pool->workers[j].thread, NULL);
+    workers_free(machine);
+    return -1;
+  }
+
+  workers_go(pool, WORK_HOME);
+  cm_wire(machine);
+  return 0;
+}
+
+/* Stops the workers. The chips stay where the workers put them */
+void cm_workers_stop(cm *machine)
+{
+  struct cm_workers *pool = machine->workers;
+  if (pool == NULL) return;
+  cm_fence(machine);
+  workers_go(pool, WORK_STOP);
+  uint32_t i;
+  for (i = 0; i < pool->count; i++) pthread_join(pool->workers[i].thread, NULL);
+  workers_free(machine);
+}
+
+void cm_workers_exe(cm *machine, uint16_t addrA, uint16_t addrB, uint8_t flagR, uint8_t flagW, uint8_t flagC,
+                    uint8_t sense, uint8_t memTruth, uint8_t flagTruth)
+{
+  struct cm_workers *pool = machine->workers;
+  pool->addrA = addrA;
+  pool->addrB = addrB;
+  pool->flagR = flagR;
+  pool->flagW = flagW;
+  pool->flagC = flagC;
+  pool->sense = sense;
+  pool->memTruth = memTruth;
+  pool->flagTruth = flagTruth;
+  workers_go(pool, WORK_EXE);
+}
+
+void cm_workers_recv(cm *machine)
+{
+  struct cm_workers *pool = machine->workers;
+  uint32_t i, dim;
+
+  /* Only a full buffer with a message coming in can refer */
+  pool->recv = 1;
+  for (i = 0; i < (1 << DIMENSIONS) && pool->recv; i++)
+  {
+    Router *r = machine->chips[i]->router;
+    if (r->buffer[BUFSIZE - 1] == NULL) continue;
+    for (dim = 0; dim < DIMENSIONS; dim++)
+    {
+      if (r->inports[dim])
+      {
+        pool->recv = 0;
+        break;
+      }
+    }
+  }
+
+  if (machine->cube || pool->recv) workers_go(pool, WORK_RECV);
+  if (!pool->recv)
+  {
+    for (i = 0; i < (1 << DIMENSIONS); i++)
+    {
+      chip_recv(machine->chips[i], machine->petitCounter, machine->slowMode, machine->combine);
+    }
+  }
+}
+
+/* Adds the node of each page in pages to local and remote, or to absent if it hasn't been made yet.
+ * Returns -1 if the kernel can't say.
+ */
+static int workers_where(void **pages, uint32_t n, int node, uint64_t *local, uint64_t *remote,
+                         uint64_t *absent)
+{
+  int status[PLACEMENT_BATCH];
+  uint32_t i;
+  if (syscall(SYS_move_pages, 0, (unsigned long)n, pages, NULL, status, 0) < 0) return -1;
+  for (i = 0; i < n; i++)
+  {
+    if (status[i] < 0) (*absent)++;
+    else if (status[i] == node) (*local)++;
+    else (*remote)++;
+  }
+  return 0;
+}
+
+static void *workers_page(const void *p, long pageSize)
+{
+  return (void *)((uintptr_t)p & ~(uintptr_t)(pageSize - 1));
+}
+
+static uint32_t workers_owner(struct cm_workers *pool, uint32_t chip)
+{
+  uint32_t i = 0;
+  while (chip >= pool->workers[i].last) i++;
+  return i;
+}
+
+/* Writes where each worker is running and where its chips and memory ended up, then how many of the cube
+ * wires run between workers and between nodes. Returns -1 if there are no workers running, or the
+ * kernel can't say where pages are, in which case only the workers and wires are written.
+ */
+int cm_placement(cm *machine, FILE *out)
+{
+  struct cm_workers *pool = machine->workers;
+  if (pool == NULL) return -1;
+  cm_fence(machine);
+
+  long pageSize = sysconf(_SC_PAGESIZE);
+  void *pages[PLACEMENT_BATCH];
+  uint32_t i, j, k, n;
+  int ret = 0;
+  uint64_t allLocal = 0, allRemote = 0;
+
+  for (i = 0; i < pool->count; i++)
+  {
+    struct cm_worker *w = pool->workers + i;
+    fprintf(out, "worker %u: cpu %d, node %d, chips %u to %u\n", i, w->cpu, w->node, w->first, w->last - 1);
+    if (ret) continue;
+
+    /* The chips' structures, a page for each */
+    uint64_t local = 0, remote = 0, absent = 0;
+    n = 0;
+    for (j = w->first; j < w->last && !ret; j++)
+    {
+      Chip *c = machine->chips[j];
+      if (n + 2 + (1 << PROCESSORS) > PLACEMENT_BATCH)
+      {
+        ret = workers_where(pages, n, w->node, &local, &remote, &absent);
+        n = 0;
+      }
+      pages[n++] = workers_page(c, pageSize);
+      pages[n++] = workers_page(c->router, pageSize);
+      for (k = 0; k < (1 << PROCESSORS); k++) pages[n++] = workers_page(c->cells[k], pageSize);
+    }
+    if (n && !ret) ret = workers_where(pages, n, w->node, &local, &remote, &absent);
+    if (ret)
+    {
+      fprintf(out, "  placement unavailable\n");
+      continue;
+    }
+    fprintf(out, "  structures: %llu local, %llu remote\n", (unsigned long long)local,
+            (unsigned long long)remote);
+    allLocal += local;
+    allRemote += remote;
+
+    /* Its stretch of every memory plane */
+    local = remote = absent = 0;
+    size_t stretch = (size_t)(w->last - w->first) * (1 << PROCESSORS) * PAGE_BYTES;
+    for (j = 0; j < CELL_PAGES && !ret; j++)
+    {
+      uint8_t *from = machine->memory + (size_t)j * PLANE_BYTES
+                      + (size_t)w->first * (1 << PROCESSORS) * PAGE_BYTES;
+      size_t at;
+      n = 0;
+      for (at = 0; at < stretch && !ret; at += pageSize)
+      {
+        pages[n++] = workers_page(from + at, pageSize);
+        if (n == PLACEMENT_BATCH)
+        {
+          ret = workers_where(pages, n, w->node, &local, &remote, &absent);
+          n = 0;
+        }
+      }
+      if (n && !ret) ret = workers_where(pages, n, w->node, &local, &remote, &absent);
+    }
+    fprintf(out, "  memory pages: %llu local, %llu remote, %llu not yet written\n",
+            (unsigned long long)local, (unsigned long long)remote, (unsigned long long)absent);
+    allLocal += local;
+    allRemote += remote;
+  }
+
+  if (!ret)
+  {
+    fprintf(out, "remote: %llu of %llu structures and pages (%.1f%%)\n", (unsigned long long)allRemote,
+            (unsigned long long)(allLocal + allRemote),
+            allLocal + allRemote ? 100.0 * allRemote / (allLocal + allRemote) : 0.0);
+  }
+
+  /* Each wire is counted once, from its lower numbered end */
+  uint64_t wires = 0, crossWorkers = 0, crossNodes = 0;
+  for (i = 0; i < (1 << DIMENSIONS); i++)
+  {
+    uint32_t from = workers_owner(pool, i);
+    for (j = 0; j < DIMENSIONS; j++)
+    {
+      uint32_t other = i ^ (1 << j);
+      if (other < i) continue;
+      uint32_t to = workers_owner(pool, other);
+      wires++;
+      if (to != from) crossWorkers++;
+      if (pool->workers[to].node != pool->workers[from].node) crossNodes++;
+    }
+  }
+  fprintf(out, "cube wires: %llu, %llu between workers (%.1f%%), %llu between nodes (%.1f%%)\n",
+          (unsigned long long)wires, (unsigned long long)crossWorkers, 100.0 * crossWorkers / wires,
+          (unsigned long long)crossNodes, 100.0 * crossNodes / wires);
+  return ret;
+}
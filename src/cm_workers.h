@@ -0,0 +1,17 @@
+#ifndef CM_WORKERS_H_
+#define CM_WORKERS_H_
+
+#include "connection_machine.h"
+
+/* The halves of cm_exe handed to the workers, either side of the NEWS grid. The first runs the
+ * instruction and the router on every chip, the second the cube exchange and receiving.
+ */
+void cm_workers_exe(cm *machine, uint16_t addrA, uint16_t addrB, uint8_t flagR, uint8_t flagW, uint8_t flagC,
+                    uint8_t sense, uint8_t memTruth, uint8_t flagTruth);
+
+void cm_workers_recv(cm *machine);
+
+/* Connects every chip to its neighbours, and its router to the next chip's for referrals */
+void cm_wire(cm *machine);
+
+#endif
@@ -2,6 +2,14 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "cm_trace.h"
+#include "cm_trigger.h"
+#include "cm_profile.h"
+#include "cm_workers.h"
 #include "cm_dump.c"
 
 /* Firstly, we need to build a connection machine out of chips, and connect all the wires together in a
@@ -10,16 +18,10 @@
 
 uint32_t count;
 
-
-cm *cm_build()
+/* Referrals go to the next chip along, and cube wires to every chip one bit different */
+void cm_wire(cm *machine)
 {
-  cm *machine = (cm *)calloc(1, sizeof(cm));
-  uint32_t i;
-  for (i = 0; i < (1 << DIMENSIONS); i++)
-  {
-    machine->chips[i] = chip_build();
-  }
-
+  uint32_t i, dim;
   for (i = 0; i < (1 << DIMENSIONS); i++)
   {
     machine->chips[i]->router->referer = machine->chips[ (i+1) % (1 << DIMENSIONS) ]->router;
@@ -28,7 +30,6 @@ cm *cm_build()
   /* All the chips are build. Just need to connect each one with adjacent ones. This can be done by
    * iterating over all chips, and running connect with every index that has exactly 1 different bit
    */
-  uint32_t dim;
   for (i = 0; i < (1 << DIMENSIONS); i++)
   {
     for (dim = 0; dim < DIMENSIONS; dim++)
@@ -36,18 +37,195 @@ cm *cm_build()
       chip_connect(machine->chips[i], machine->chips[i ^ (1 << dim)], DIMENSIONS - 1 - dim);
     }
   }
+}
+
+/* Chips are laid over memory, which the caller has already set up */
+static cm *cm_build_over(uint8_t *memory)
+{
+  cm *machine = (cm *)calloc(1, sizeof(cm));
+  machine->memory = memory;
+  machine->prefetched[0] = machine->prefetched[1] = -1;
+
+  uint32_t i;
+  for (i = 0; i < (1 << DIMENSIONS); i++)
+  {
+    machine->chips[i] = chip_build(machine->memory + i * (1 << PROCESSORS) * PAGE_BYTES);
+  }
+
+  cm_wire(machine);
   count = 0;
 
   return machine;
 }
 
+cm *cm_build()
+{
+  /* The cell memory is reserved rather than allocated. Nothing is zeroed up front, and the host only
+   * has to find room for the pages that actually get written.
+   */
+  uint8_t *memory = (uint8_t *)mmap(NULL, (size_t)CELL_PAGES * PLANE_BYTES, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (memory == MAP_FAILED) return NULL;
+  return cm_build_over(memory);
+}
+
+/* The same, but with the cell memory kept in a file, for configurations with more memory than the host
+ * has. The file is created sparse if it doesn't exist, so again only written pages take up room. A file
+ * of the right size is picked up as it is, memory and all, so a machine can be put away and come back
+ * later. The kernel is told the memory will be swept through in order, which is how instructions use it,
+ * and cm_prefetch asks for the planes coming up next to be read in ahead of time.
+ */
+cm *cm_build_file(const char *fileName)
+{
+  size_t size = (size_t)CELL_PAGES * PLANE_BYTES;
+  int fd = open(fileName, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) return NULL;
+
+  struct stat st;
+  uint8_t existing = 0;
+  if (fstat(fd, &st) || (st.st_size != 0 && (size_t)st.st_size != size))
+  {
+    close(fd);
+    return NULL; /* Something else, or a machine of a different size */
+  }
+  if (st.st_size) existing = 1;
+  else if (ftruncate(fd, size))
+  {
+    close(fd);
+    return NULL;
+  }
+
+  uint8_t *memory = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) return NULL;
+  madvise(memory, size, MADV_SEQUENTIAL);
+
+  cm *machine = cm_build_over(memory);
+  machine->mapped = 1;
+  if (existing)
+  {
+    uint32_t i, j;
+    for (i = 0; i < (1 << DIMENSIONS); i++)
+    {
+      for (j = 0; j < (1 << PROCESSORS); j++) machine->chips[i]->cells[j]->live = (1 << CELL_PAGES) - 1;
+    }
+  }
+  return machine;
+}
+
+/* Asks for the planes holding addrA and addrB to be read in, if memory is a file. Planes asked for last
+ * time are skipped, so calling this before every instruction only costs anything when the planes change.
+ */
+void cm_prefetch(cm *machine, uint16_t addrA, uint16_t addrB)
+{
+  if (!machine->mapped) return;
+  int8_t pages[2] = {addrA / PAGE_BITS, addrB / PAGE_BITS};
+  uint32_t i;
+  for (i = 0; i < 2; i++)
+  {
+    if (pages[i] == machine->prefetched[0] || pages[i] == machine->prefetched[1]) continue;
+    madvise(machine->memory + (size_t)pages[i] * PLANE_BYTES, PLANE_BYTES, MADV_WILLNEED);
+  }
+  machine->prefetched[0] = pages[0];
+  machine->prefetched[1] = pages[1];
+}
+
 /* We can delete a machine by deleting all of its chips then freeing it */
 void cm_del(cm *machine)
 {
+  cm_async_stop(machine);
+  cm_workers_stop(machine);
+  if (machine->trace) cm_trace_stop(machine);
+  cm_history_stop(machine);
+  cm_observer_del(machine);
+  cm_profile_del(machine);
   for (uint32_t i = 0; i < (1 << DIMENSIONS); i++) chip_del(machine->chips[i]);
+  munmap(machine->memory, (size_t)CELL_PAGES * PLANE_BYTES);
   free(machine);
 }
 
+/* The NEWS grid. Chips are laid out left to right, top to bottom in a square, each holding a square of
+ * cells laid out the same way, so the machine is a 256 x 256 grid of cells. Each instruction every cell
+ * reads the flag output of its neighbour in newsDir: from below for North (0), from the left for East
+ * (1), from the right for West (2) and from above for South (3). At the edges of the machine the wire
+ * either wraps around to the other side or, with nothing driving it, reads 0.
+ *
+ * Rather than go cell by cell, the outputs are gathered into rows of 64 bit words. A move North or South
+ * is then just picking a different row, and East or West a one bit shift along the row.
+ */
+
+#define NEWS_CHIPS (1 << (DIMENSIONS >> 1)) /* Chips along a side */
+#define NEWS_SQW (1 << (PROCESSORS >> 1)) /* Cells along a side of a chip */
+#define NEWS_SIDE (NEWS_CHIPS * NEWS_SQW) /* Cells along a side of the machine */
+#define NEWS_WORDS ((NEWS_SIDE + 63) >> 6)
+
+static void cm_news(cm *machine, uint8_t newsDir)
+{
+  uint64_t grid[NEWS_SIDE][NEWS_WORDS];
+  uint64_t moved[NEWS_WORDS];
+  uint32_t i, r, w;
+
+  for (r = 0; r < NEWS_SIDE; r++) for (w = 0; w < NEWS_WORDS; w++) grid[r][w] = 0;
+  for (i = 0; i < (1 << DIMENSIONS); i++)
+  {
+    uint32_t row = (i / NEWS_CHIPS) * NEWS_SQW, col = (i % NEWS_CHIPS) * NEWS_SQW;
+    for (r = 0; r < NEWS_SQW; r++)
+    {
+      uint64_t bits = (machine->chips[i]->outputs >> (r * NEWS_SQW)) & ((1 << NEWS_SQW) - 1);
+      grid[row + r][col >> 6] |= bits << (col & 63);
+    }
+  }
+
+  /* Now work out what each row receives and hand it back out to the cells, row by row */
+  for (r = 0; r < NEWS_SIDE; r++)
+  {
+    if (newsDir == 0 || newsDir == 3) /* North or South */
+    {
+      int32_t from = (newsDir == 0) ? (int32_t)r + 1 : (int32_t)r - 1;
+      if (from < 0 || from == NEWS_SIDE)
+      {
+        if (machine->newsWrap) from = (from + NEWS_SIDE) % NEWS_SIDE;
+        else from = -1;
+      }
+      for (w = 0; w < NEWS_WORDS; w++) moved[w] = (from < 0) ? 0 : grid[from][w];
+    }
+    else if (newsDir == 1) /* East, so everything moves one column to the right */
+    {
+      uint64_t carry = machine->newsWrap ? (grid[r][NEWS_WORDS - 1] >> ((NEWS_SIDE - 1) & 63)) & 1 : 0;
+      for (w = 0; w < NEWS_WORDS; w++)
+      {
+        moved[w] = (grid[r][w] << 1) | carry;
+        carry = grid[r][w] >> 63;
+      }
+    }
+    else /* West, one column to the left */
+    {
+      uint64_t carry = machine->newsWrap ? grid[r][0] & 1 : 0;
+      for (w = NEWS_WORDS; w-- > 0;)
+      {
+        uint64_t top = (w == NEWS_WORDS - 1) ? (NEWS_SIDE - 1) & 63 : 63;
+        moved[w] = (grid[r][w] >> 1) | (carry << top);
+        carry = grid[r][w] & 1;
+      }
+    }
+
+    /* NEWS is flag 7, so bit 8 */
+    uint32_t row = (r / NEWS_SQW) * NEWS_CHIPS, cellRow = (r % NEWS_SQW) * NEWS_SQW;
+    for (i = 0; i < NEWS_CHIPS; i++)
+    {
+      Chip *c = machine->chips[row + i];
+      uint32_t col = i * NEWS_SQW;
+      uint32_t j;
+      for (j = 0; j < NEWS_SQW; j++)
+      {
+        Cell *cell = c->cells[cellRow + j];
+        if ((moved[(col + j) >> 6] >> ((col + j) & 63)) & 1) cell->flags |= 1 << 8;
+        else cell->flags &= ~(1 << 8);
+      }
+    }
+  }
+}
+
 /* We can then easily implement a wrapper for chips to execute based on instruction calls to the machine
  */
 
@@ -55,15 +233,42 @@ void cm_exe(cm *machine, uint16_t addrA, uint16_t addrB, uint8_t flagR, uint8_t
             uint8_t sense, uint8_t memTruth, uint8_t flagTruth, uint8_t newsDir)
 {
   uint32_t i;
-  for (i = 0; i < (1 << DIMENSIONS); i++)
+  if (machine->workers)
   {
-    //if (count == 193) printf("%u %u\n", i, machine->petitCounter);
-    chip_exe(machine->chips[i], addrA, addrB, flagR, flagW, flagC, sense, memTruth, flagTruth, newsDir,
-             machine->petitCounter, machine->shouldOr, machine->slowMode);
+    cm_workers_exe(machine, addrA, addrB, flagR, flagW, flagC, sense, memTruth, flagTruth);
   }
-  for (i = 0; i < (1 << DIMENSIONS); i++)
+  else
+  {
+    for (i = 0; i < (1 << DIMENSIONS); i++)
+    {
+      //if (count == 193) printf("%u %u\n", i, machine->petitCounter);
+      chip_exe(machine->chips[i], addrA, addrB, flagR, flagW, flagC, sense, memTruth, flagTruth,
+               machine->petitCounter, machine->shouldOr, machine->slowMode, machine->combine);
+    }
+  }
+  /* The daisy chain runs on from the last cell of each chip into the first of the next, which like NEWS
+   * can only happen once every chip has run. Nothing drives chip 0's first cell. Daisy chain is flag 3,
+   * so bit 12.
+   */
+  machine->chips[0]->cells[0]->flags &= ~(1 << 12);
+  for (i = 1; i < (1 << DIMENSIONS); i++)
   {
-    chip_recv(machine->chips[i], machine->petitCounter, machine->slowMode);
+    Cell *first = machine->chips[i]->cells[0];
+    uint16_t last = (machine->chips[i-1]->outputs >> ((1 << PROCESSORS) - 1)) & 1;
+    first->flags = (first->flags & ~(1 << 12)) | (last << 12);
+  }
+  cm_news(machine, newsDir);
+  if (machine->workers) cm_workers_recv(machine);
+  else
+  {
+    if (machine->cube)
+    {
+      for (i = 0; i < (1 << DIMENSIONS); i++) chip_cube(machine->chips[i], machine->cube - 1);
+    }
+    for (i = 0; i < (1 << DIMENSIONS); i++)
+    {
+      chip_recv(machine->chips[i], machine->petitCounter, machine->slowMode, machine->combine);
+    }
   }
 
   /* The global pin should be obtained from the logical or of all the global flags (flag 1) of the
@@ -80,64 +285,165 @@ void cm_exe(cm *machine, uint16_t addrA, uint16_t addrB, uint8_t flagR, uint8_t
       machine->chips[i]->cells[j]->flags &= ~(1 << 14);
     }
   }
-  if (machine->dump)
+  if (machine->dump || RECORDING(machine) || machine->observer)
   {
-    uint64_t ins = 0;
-    ins |= addrA;
-    ins = ins << 12; ins |= addrB;
-    ins = ins << 4; ins |= flagR;
-    ins = ins << 4; ins |= flagW;
-    ins = ins << 4; ins |= flagC;
-    ins = ins << 1; ins |= sense;
-    ins = ins << 8; ins |= memTruth;
-    ins = ins << 8; ins |= flagTruth;
-    ins = ins << 2; ins |= newsDir;
-    cm_dump(machine, count, ins, "dump.dat");
+    uint64_t ins = cm_pack(addrA, addrB, flagR, flagW, flagC, sense, memTruth, flagTruth, newsDir);
+    if (machine->dump) cm_dump(machine, count, ins, "dump.dat");
+    if (RECORDING(machine))
+    {
+      cm_trace_record(machine, TRACE_INS, ins);
+#if ADDR_BITS > 12
+      cm_trace_record(machine, TRACE_DATA, ins); /* Too wide to fit in the record itself */
+#endif
+    }
+    if (machine->observer) cm_observer_step(machine, ins);
   }
   count++;
+  machine->cycle++;
   machine->petitCounter++;
-  if (machine->petitCounter >= (ADDRLEN + (MESSAGE_LENGTH << 3) + 3 +
-                               (DIMENSIONS * (machine->slowMode ? ADDRLEN + (MESSAGE_LENGTH << 3) + 2
-                                                                : 1)) +
-                               (MESSAGE_LENGTH << 3) + 2)) machine->petitCounter = 0;}
+  if (machine->petitCounter >= PETIT_LENGTH(machine->slowMode)) machine->petitCounter = 0;
+  if (machine->history) cm_history_step(machine);
+}
+
+/* Instructions are packed into 64 bits for dumps and traces, with the fields laid out back to back from
+ * addrA down to newsDir. Addresses take ADDR_BITS each, so 12 unless CELL_BITS has been raised.
+ * cm_exe_packed unpacks and runs one.
+ */
+uint64_t cm_pack(uint16_t addrA, uint16_t addrB, uint8_t flagR, uint8_t flagW, uint8_t flagC,
+                 uint8_t sense, uint8_t memTruth, uint8_t flagTruth, uint8_t newsDir)
+{
+  uint64_t ins = 0;
+  ins |= addrA;
+  ins = ins << ADDR_BITS; ins |= addrB;
+  ins = ins << 4; ins |= flagR;
+  ins = ins << 4; ins |= flagW;
+  ins = ins << 4; ins |= flagC;
+  ins = ins << 1; ins |= sense;
+  ins = ins << 8; ins |= memTruth;
+  ins = ins << 8; ins |= flagTruth;
+  ins = ins << 2; ins |= newsDir;
+  return ins;
+}
+
+void cm_exe_packed(cm *machine, uint64_t ins)
+{
+  cm_exe(machine, INS_ADDRA(ins), INS_ADDRB(ins), (ins >> 27) & 0xF, (ins >> 23) & 0xF, (ins >> 19) & 0xF,
+         (ins >> 18) & 1, (ins >> 10) & 0xFF, (ins >> 2) & 0xFF, ins & 3);
+}
+
+/* Host access to the cells, addressed by chip number * 16 + cell number. Fields are up to 64 bits with
+ * addr as the most significant bit. Writes made through here are recorded in traces, whereas writes
+ * made directly through chips[] are not. All of these wait for submitted instructions to finish first.
+ */
+void cm_write_field(cm *machine, uint32_t cell, uint16_t addr, uint8_t len, uint64_t value)
+{
+  cm_fence(machine);
+  cell_write_field(machine->chips[cell >> PROCESSORS]->cells[cell & ((1 << PROCESSORS) - 1)], addr, len,
+                   value);
+  if (RECORDING(machine))
+  {
+    cm_trace_record(machine, TRACE_FIELD, ((uint64_t)cell << 24) | ((uint32_t)addr << 8) | len);
+    cm_trace_record(machine, TRACE_DATA, value);
+  }
+}
+
+uint64_t cm_read_field(cm *machine, uint32_t cell, uint16_t addr, uint8_t len)
+{
+  cm_fence(machine);
+  return cell_read_field(machine->chips[cell >> PROCESSORS]->cells[cell & ((1 << PROCESSORS) - 1)], addr,
+                         len);
+}
+
+void cm_write_flag(cm *machine, uint32_t cell, uint8_t flag, uint8_t value)
+{
+  cm_fence(machine);
+  Cell *c = machine->chips[cell >> PROCESSORS]->cells[cell & ((1 << PROCESSORS) - 1)];
+  if (value) c->flags |= 1 << (15 - flag);
+  else c->flags &= ~(1 << (15 - flag));
+  if (RECORDING(machine))
+  {
+    cm_trace_record(machine, TRACE_FLAG, ((uint64_t)cell << 24) | (flag << 8) | (value != 0));
+  }
+}
+
+uint8_t cm_read_flag(cm *machine, uint32_t cell, uint8_t flag)
+{
+  cm_fence(machine);
+  return (machine->chips[cell >> PROCESSORS]->cells[cell & ((1 << PROCESSORS) - 1)]->flags >> (15 - flag))
+         & 1;
+}
 
-/* Setting slow mode and or mode should only be allowable at the beginning of a cycle */
+/* Setting slow mode and or mode should only be allowable at the beginning of a cycle. These, like
+ * everything else that looks at the machine from the host, wait for submitted instructions first.
+ */
 uint8_t shouldOr(cm *machine)
 {
+  cm_fence(machine);
   if (machine->petitCounter) return -1;
   else
   {
     machine->shouldOr = 1;
+    if (RECORDING(machine)) cm_trace_mode(machine);
     return 0;
   }
 }
 
 uint8_t shouldntOr(cm *machine)
 {
+  cm_fence(machine);
   if (machine->petitCounter) return -1;
   else
   {
     machine->shouldOr = 0;
+    if (RECORDING(machine)) cm_trace_mode(machine);
     return 0;
   }
 }
 
+/* Combining is a router setting like the above, so the same restriction applies. Modes are the
+ * COMBINE_ values from router.h; anything else is rejected.
+ */
+uint8_t combineMode(cm *machine, uint8_t mode)
+{
+  cm_fence(machine);
+  if (machine->petitCounter || mode > COMBINE_MAX) return -1;
+  else
+  {
+    machine->combine = mode;
+    if (RECORDING(machine)) cm_trace_mode(machine);
+    return 0;
+  }
+}
+
+/* Total number of messages that have been merged away by combining since the machine was built */
+uint32_t cm_combined(cm *machine)
+{
+  uint32_t i, total = 0;
+  cm_fence(machine);
+  for (i = 0; i < (1 << DIMENSIONS); i++) total += machine->chips[i]->router->combined;
+  return total;
+}
+
 uint8_t slowMode(cm *machine)
 {
+  cm_fence(machine);
   if (machine->petitCounter) return -1;
   else
   {
     machine->slowMode = 1;
+    if (RECORDING(machine)) cm_trace_mode(machine);
     return 0;
   }
 }
 
 uint8_t fastMode(cm *machine)
 {
+  cm_fence(machine);
   if (machine->petitCounter) return -1;
   else
   {
     machine->slowMode = 0;
+    if (RECORDING(machine)) cm_trace_mode(machine);
     return 0;
   }
 }
@@ -162,24 +468,113 @@ uint8_t shouldntDump(cm *machine)
   }
 }
 
+/* Whether the NEWS grid wraps around at the edges of the machine. It has nothing to do with the router
+ * so can be changed at any time, and never fails.
+ */
+uint8_t newsWrap(cm *machine)
+{
+  cm_fence(machine);
+  machine->newsWrap = 1;
+  if (RECORDING(machine)) cm_trace_mode(machine);
+  return 0;
+}
+
+uint8_t newsNoWrap(cm *machine)
+{
+  cm_fence(machine);
+  machine->newsWrap = 0;
+  if (RECORDING(machine)) cm_trace_mode(machine);
+  return 0;
+}
+
+/* The cube wires can carry flag outputs directly as well as messages. With a dimension set, every
+ * instruction each cell's cube flag (flag 6) takes the flag output of the matching cell on the chip at
+ * the other end of that wire, so a hypercube neighbour exchange takes one cycle rather than a petit
+ * cycle. Dimensions are numbered as the routers number them.
+ */
+uint8_t cubeDim(cm *machine, uint8_t dim)
+{
+  cm_fence(machine);
+  if (dim >= DIMENSIONS) return -1;
+  machine->cube = dim + 1;
+  if (RECORDING(machine)) cm_trace_mode(machine);
+  return 0;
+}
+
+uint8_t cubeOff(cm *machine)
+{
+  cm_fence(machine);
+  machine->cube = 0;
+  if (RECORDING(machine)) cm_trace_mode(machine);
+  return 0;
+}
+
 /* It will also be useful to have a way to synchronise the machine to petit cycle 0 by basically doing
  * noops until it gets there. NOTE that this does not flush routers!
  */
 
 void petit_sync(cm *machine)
 {
+  cm_fence(machine);
+  uint32_t from = machine->cycle;
   while (machine->petitCounter != 0)
   {
     cm_exe(machine, 0, 0, 0, 0, 0, 0, IDM, IDF, 0);
   }
+  if (machine->profile) cm_profile_stall(machine, machine->cycle - from);
 }
 
 int network_empty(cm *machine)
 {
   uint32_t i;
+  int busy = 0;
+  cm_fence(machine);
+  for (i = 0; i < (1 << DIMENSIONS) && !busy; i++) busy = router_empty(machine->chips[i]->router);
+  if (machine->profile) cm_profile_poll(machine, busy);
+  return busy;
+}
+
+/* How much cell memory is in use, in bytes. Only pages that have been written count. */
+uint64_t cm_resident(cm *machine)
+{
+  uint64_t pages = 0;
+  uint32_t i, j;
+  for (i = 0; i < (1 << DIMENSIONS); i++)
+  {
+    for (j = 0; j < (1 << PROCESSORS); j++) pages += __builtin_popcount(machine->chips[i]->cells[j]->live);
+  }
+  return pages * PAGE_BYTES;
+}
+
+/* The build settings, for bindings in other languages that can't see them. Any pointer can be NULL */
+void cm_geometry(uint32_t *dimensions, uint32_t *cellBits, uint64_t *frameBytes)
+{
+  if (dimensions) *dimensions = DIMENSIONS;
+  if (cellBits) *cellBits = CELL_BITS;
+  if (frameBytes) *frameBytes = FRAME_BYTES;
+}
+
+/* The cell memory itself, laid out as described in cell.h, once everything submitted has run. Pages that
+ * have never been written are zeros, so it can be read as it is.
+ */
+uint8_t *cm_memory(cm *machine)
+{
+  cm_fence(machine);
+  return machine->memory;
+}
+
+/* Marks page in every cell as written, for when something other than the cells is about to write into
+ * that plane of memory directly. Writes like that never reach a trace or the history log, so they'd leave
+ * replays rebuilding the wrong state; while either is being kept this refuses with -1.
+ */
+int cm_mark_live(cm *machine, uint16_t page)
+{
+  uint32_t i, j;
+  cm_fence(machine);
+  if (page >= CELL_PAGES || RECORDING(machine)) return -1;
   for (i = 0; i < (1 << DIMENSIONS); i++)
   {
-    if (router_empty(machine->chips[i]->router)) return 1;
+    for (j = 0; j < (1 << PROCESSORS); j++) machine->chips[i]->cells[j]->live |= 1 << page;
   }
   return 0;
 }
@@ -1,33 +1,118 @@
 #ifndef CM_CM_H_
 #define CM_CM_H_
 
+#include <stdio.h>
 #include "chip.h"
 
 typedef struct
 {
   Chip *chips[1 << DIMENSIONS];
+  uint8_t *memory; /* Every cell's memory, see cell.h */
+  uint8_t mapped; /* memory is a file, see cm_build_file */
+  int8_t prefetched[2]; /* Pages last asked for by cm_prefetch */
   uint32_t petitCounter;
   uint8_t shouldOr;
   uint8_t slowMode;
+  uint8_t combine;
+  uint8_t newsWrap;
+  uint8_t cube; /* 0 for no cube exchange, otherwise the dimension + 1 */
   uint8_t globalPin;
   uint8_t dump;
+  uint32_t cycle; /* Calls to cm_exe on this machine */
+  FILE *trace;
+  struct cm_queue *queue; /* Asynchronous submission, see cm_queue.c */
+  struct cm_observer *observer; /* Watches and observers, see cm_trigger.c */
+  struct cm_profile *profile; /* Region totals, see cm_profile.c */
+  struct cm_workers *workers; /* Threads running the chips, see cm_workers.c */
+  struct cm_history *history; /* Checkpoints and the log since, see cm_history.c */
 } cm;
 
+/* What the machine records about each cycle while it's being observed */
+typedef struct
+{
+  uint64_t ins; /* Packed as by cm_pack */
+  uint32_t cycle;
+  uint32_t petitCounter;
+  uint32_t referred; /* Totals over every router so far */
+  uint32_t parityFailed;
+  uint32_t fired; /* Bit n set if watch n fired */
+  uint8_t globalPin;
+} cm_frame;
+
+typedef void (*cm_observer_fn)(cm *machine, const cm_frame *frame, void *user);
+
+#define ROUTER_EVENT_REFER 0
+#define ROUTER_EVENT_PARITY 1
+
 cm *cm_build();
 
+cm *cm_build_file(const char *fileName);
+
+void cm_prefetch(cm *machine, uint16_t addrA, uint16_t addrB);
+
 void cm_del(cm *machine);
 
 void cm_exe(cm *machine, uint16_t addrA, uint16_t addrB, uint8_t flagR, uint8_t flagW, uint8_t flagC,
             uint8_t sense, uint8_t memTruth, uint8_t flagTruth, uint8_t newsDir);
 
+void cm_exe_packed(cm *machine, uint64_t ins);
+
+/* The addresses in a packed instruction */
+#define INS_ADDRA(ins) (((ins) >> (31 + ADDR_BITS)) & ((1 << ADDR_BITS) - 1))
+#define INS_ADDRB(ins) (((ins) >> 31) & ((1 << ADDR_BITS) - 1))
+
+uint64_t cm_pack(uint16_t addrA, uint16_t addrB, uint8_t flagR, uint8_t flagW, uint8_t flagC,
+                 uint8_t sense, uint8_t memTruth, uint8_t flagTruth, uint8_t newsDir);
+
+void cm_write_field(cm *machine, uint32_t cell, uint16_t addr, uint8_t len, uint64_t value);
+
+uint64_t cm_read_field(cm *machine, uint32_t cell, uint16_t addr, uint8_t len);
+
+void cm_write_flag(cm *machine, uint32_t cell, uint8_t flag, uint8_t value);
+
+uint8_t cm_read_flag(cm *machine, uint32_t cell, uint8_t flag);
+
+int cm_async_start(cm *machine);
+
+void cm_async_stop(cm *machine);
+
+void cm_submit(cm *machine, uint16_t addrA, uint16_t addrB, uint8_t flagR, uint8_t flagW, uint8_t flagC,
+               uint8_t sense, uint8_t memTruth, uint8_t flagTruth, uint8_t newsDir);
+
+void cm_submit_packed(cm *machine, uint64_t ins);
+
+void cm_submit_batch(cm *machine, const uint64_t *ins, uint32_t n);
+
+void cm_fence(cm *machine);
+
+uint8_t cm_wait_global_pin(cm *machine);
+
+int cm_workers_start(cm *machine, uint32_t count);
+
+void cm_workers_stop(cm *machine);
+
+int cm_placement(cm *machine, FILE *out);
+
 uint8_t shouldOr(cm *machine);
 
 uint8_t shouldntOr(cm *machine);
 
+uint8_t combineMode(cm *machine, uint8_t mode);
+
+uint32_t cm_combined(cm *machine);
+
 uint8_t slowMode(cm *machine);
 
 uint8_t fastMode(cm *machine);
 
+uint8_t newsWrap(cm *machine);
+
+uint8_t newsNoWrap(cm *machine);
+
+uint8_t cubeDim(cm *machine, uint8_t dim);
+
+uint8_t cubeOff(cm *machine);
+
 void petit_sync(cm *machine);
 
 uint8_t shouldDump(cm *machine);
@@ -38,6 +123,233 @@ int network_empty(cm *machine);
 
 void cycles();
 
+int32_t cm_count_flag(cm *machine, uint8_t flag);
+
+int32_t cm_count_bit(cm *machine, uint16_t addr);
+
+int cm_reduce_field(cm *machine, uint16_t addr, uint8_t len, uint8_t op, uint64_t *result);
+
+int32_t cm_find_first(cm *machine, uint8_t flag);
+
+int cm_scan_flag(cm *machine, uint8_t flag, uint16_t dst, uint8_t len, uint8_t op, uint8_t segment);
+
+int cm_scan_field(cm *machine, uint16_t src, uint16_t dst, uint8_t len, uint8_t op, uint8_t segment);
+
+int32_t cm_enumerate(cm *machine, uint8_t flag, uint16_t dst, uint8_t len);
+
+uint64_t cm_hash(cm *machine);
+
+uint64_t cm_resident(cm *machine);
+
+void cm_geometry(uint32_t *dimensions, uint32_t *cellBits, uint64_t *frameBytes);
+
+uint8_t *cm_memory(cm *machine);
+
+int cm_mark_live(cm *machine, uint16_t page);
+
+/* Dump frames, see cm_dump.c. A chip's cells are its flags and memory, then its router's buffer,
+ * listening processors and partial messages
+ */
+#define FRAME_CHIP_BYTES ((1 << PROCESSORS) * (sizeof(uint16_t) + CELL_BYTES) + (BUFSIZE + 4) * sizeof(Message) \
+                          + 4 * sizeof(uint32_t))
+#define FRAME_BYTES ((size_t)(1 << DIMENSIONS) * FRAME_CHIP_BYTES + sizeof(uint64_t))
+
+void cm_snapshot(cm *machine, uint64_t ins, uint8_t *out);
+
+int cm_watch_field(cm *machine, uint32_t firstCell, uint32_t lastCell, uint16_t addr, uint8_t len);
+
+int cm_watch_flag(cm *machine, uint32_t firstCell, uint32_t lastCell, uint8_t flag);
+
+int cm_watch_router(cm *machine, uint8_t event);
+
+int cm_watch_cycles(cm *machine, uint32_t first, uint32_t last);
+
+uint8_t cm_watch_window(cm *machine, int id, uint32_t first, uint32_t last);
+
+int cm_capture(cm *machine, const char *fileName, uint32_t frames);
+
+void cm_observe(cm *machine, cm_observer_fn fn, void *user, uint8_t everyCycle);
+
+uint32_t cm_frames(cm *machine, cm_frame *out, uint32_t max);
+
+void cm_observer_del(cm *machine);
+
+uint8_t cm_region_begin(cm *machine, const char *name);
+
+uint8_t cm_region_end(cm *machine);
+
+int cm_profile_write(cm *machine, const char *fileName, uint8_t metric);
+
+void cm_profile_print(cm *machine);
+
+void cm_profile_del(cm *machine);
+
+int cm_trace_start(cm *machine, const char *fileName);
+
+int cm_trace_stop(cm *machine);
+
+int cm_replay(cm *machine, const char *fileName);
+
+int cm_history_start(cm *machine, uint32_t every, const char *fileName);
+
+void cm_history_stop(cm *machine);
+
+cm *cm_state_at(cm *machine, uint32_t cycle);
+
+#define PROFILE_CYCLES 0
+#define PROFILE_CALLS 1
+#define PROFILE_WALL 2 /* Microseconds */
+#define PROFILE_STALL 3
+#define PROFILE_MESSAGES 4
+#define PROFILE_METRICS 5
+
+#define REDUCE_SUM 0
+#define REDUCE_MIN 1
+#define REDUCE_MAX 2
+
+#define SCAN_OR 0
+#define SCAN_XOR 1
+#define SCAN_SUM 2
+#define SCAN_EXCLUSIVE 4 /* Or'd in, so each cell gets what came before it rather than including itself */
+
+/* Programs for the on-engine sequencer, loaded from the assembly format described in cm_asm.c */
+
+#define ASM_EXE 0
+#define ASM_JMP 1
+#define ASM_JGP 2
+#define ASM_JNGP 3
+#define ASM_LOOP 4
+#define ASM_NEXT 5
+#define ASM_SYNC 6
+#define ASM_DRAIN 7
+#define ASM_MODE 8
+#define ASM_HALT 9
+
+#define ASM_MODE_OR 0
+#define ASM_MODE_HIPRI 1
+#define ASM_MODE_SLOW 2
+#define ASM_MODE_FAST 3
+#define ASM_MODE_COMBINE 4 /* Plus the combine mode */
+
+typedef struct
+{
+  uint8_t op;
+  uint8_t untimed; /* Allowed to change how many cycles it takes */
+  uint8_t depth; /* How many loops are open while it runs */
+  uint32_t target; /* Jump target, or where a loop goes */
+  uint64_t arg; /* Packed instruction, loop count or mode */
+} cm_op;
+
+typedef struct
+{
+  cm_op *ops;
+  uint32_t length;
+  uint32_t capacity;
+  char **labels;
+  uint32_t *labelIndex;
+  uint32_t labelCount;
+} cm_program;
+
+cm_program *cm_asm_parse(const char *text);
+
+cm_program *cm_asm_load(const char *fileName);
+
+uint32_t cm_asm_optimise(cm_program *p);
+
+int cm_run(cm *machine, cm_program *p);
+
+void cm_asm_free(cm_program *p);
+
+/* Ensembles of up to 64 machines all running the same instructions, see cm_ensemble.c */
+
+typedef struct
+{
+  uint32_t size;
+  uint64_t lanes; /* A bit for each member */
+  uint64_t *memory; /* A word per cell per address, with member k's bit at bit k */
+  uint8_t *live; /* Addresses that have ever been written with a 1 */
+  uint64_t *flags; /* A word per cell per flag */
+  uint64_t *outputs; /* Flag outputs of the last instruction */
+  uint64_t busy; /* Members with messages in their networks */
+  uint64_t globalPins;
+  uint32_t petitCounter;
+  uint32_t cycle;
+  uint8_t shouldOr;
+  uint8_t slowMode;
+  uint8_t combine;
+  uint8_t newsWrap;
+  uint8_t cube;
+  cm *members[64]; /* Router state for each member */
+} cm_ensemble;
+
+cm_ensemble *cm_ensemble_build(uint32_t size);
+
+void cm_ensemble_del(cm_ensemble *e);
+
+void cm_ensemble_exe(cm_ensemble *e, uint16_t addrA, uint16_t addrB, uint8_t flagR, uint8_t flagW,
+                     uint8_t flagC, uint8_t sense, uint8_t memTruth, uint8_t flagTruth, uint8_t newsDir);
+
+uint8_t cm_ensemble_modes(cm_ensemble *e, uint8_t shouldOr, uint8_t slowMode, uint8_t combine,
+                          uint8_t newsWrap, uint8_t cube);
+
+void cm_ensemble_petit_sync(cm_ensemble *e);
+
+void cm_ensemble_write_field(cm_ensemble *e, uint32_t member, uint32_t cell, uint16_t addr, uint8_t len,
+                             uint64_t value);
+
+uint64_t cm_ensemble_read_field(cm_ensemble *e, uint32_t member, uint32_t cell, uint16_t addr,
+                                uint8_t len);
+
+void cm_ensemble_write_flag(cm_ensemble *e, uint32_t member, uint32_t cell, uint8_t flag, uint8_t value);
+
+uint8_t cm_ensemble_read_flag(cm_ensemble *e, uint32_t member, uint32_t cell, uint8_t flag);
+
+uint8_t cm_ensemble_global_pin(cm_ensemble *e, uint32_t member);
+
+int cm_ensemble_network_empty(cm_ensemble *e, uint32_t member);
+
+/* Message level router model, see cm_msgnet.c */
+
+typedef struct
+{
+  uint32_t dest;
+  uint32_t cycle; /* When the handshake bit would arrive */
+  uint8_t message[MESSAGE_LENGTH];
+} cm_delivery;
+
+typedef struct
+{
+  Router *routers[1 << DIMENSIONS];
+  struct net_pending **heads; /* Messages waiting to be sent, a queue per cell */
+  struct net_pending **tails;
+  uint16_t *offering; /* Cells with something waiting, a mask per router */
+  uint32_t waiting;
+  uint32_t petit; /* Petit cycles run */
+  uint64_t retries; /* Offers turned away for want of buffer space */
+  cm_delivery *deliveries;
+  uint32_t deliveryCount;
+  uint32_t deliveryCapacity;
+  uint8_t shouldOr;
+  uint8_t slowMode;
+  uint8_t combine;
+} cm_msgnet;
+
+cm_msgnet *cm_msgnet_build(uint8_t shouldOr, uint8_t slowMode, uint8_t combine);
+
+void cm_msgnet_del(cm_msgnet *n);
+
+void cm_msgnet_send(cm_msgnet *n, uint32_t source, uint32_t dest, const uint8_t *message);
+
+uint32_t cm_msgnet_petit(cm_msgnet *n);
+
+int cm_msgnet_busy(cm_msgnet *n);
+
+int64_t cm_msgnet_run(cm_msgnet *n, uint32_t limit);
+
+uint32_t cm_msgnet_referred(cm_msgnet *n);
+
+uint32_t cm_msgnet_combined(cm_msgnet *n);
+
 /* Also define some useful functions for instructions */
 
 #define AND 0b00000001
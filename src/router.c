@@ -23,19 +23,25 @@
 #include <stdlib.h>
 #include <stdio.h>
 
-void router_refer_deliver(Router *router, Message *m)
+void router_refer_deliver(Router *router, Message *m, uint8_t combine)
 {
+  /* Make the address relative to this router. A referred message can still be merged into one already
+   * waiting here, which saves finding it a slot at all.
+   */
+  m->address ^= (router->id << PROCESSORS);
+  if (router_combine(router, m, combine)) return;
+
   uint32_t i = 0;
   while ( (i < BUFSIZE) && (router->buffer[i] != NULL) ) i++;
-  if (i == BUFSIZE) router_refer_deliver(router->referer, m);
-  else
+  if (i == BUFSIZE)
   {
     m->address ^= (router->id << PROCESSORS);
-    router->buffer[i] = m;
+    router_refer_deliver(router->referer, m, combine);
   }
+  else router->buffer[i] = m;
 }
 
-void router_refer(Router *router, Message *m)
+void router_refer(Router *router, Message *m, uint8_t combine)
 {
   if (router->partials[0] == m) return;
 
@@ -44,13 +50,85 @@ void router_refer(Router *router, Message *m)
    * just appears "somewhere else" in the network
    */
   //printf("Referring!!\n");
+  router->referred++;
   m->address ^= (router->id << PROCESSORS);
-  router_refer_deliver(router->referer, m); return;
+  router_refer_deliver(router->referer, m, combine); return;
   /* For now, referal is not implemented, we just print an error and crash out */
   printf("Buffer exceeded\n");
   abort();
 }
 
+/* Combining networks merge messages headed for the same place as soon as they meet, so a fan in to one
+ * processor costs a single delivery rather than one per sender. Addresses are relative to the router
+ * holding the message, so two messages in the same buffer are for the same processor exactly when their
+ * addresses match. The new message is folded into the buffered one and freed; returns 1 if that
+ * happened, or 0 if the caller still has to find the message a slot.
+ */
+
+int router_combine(Router *router, Message *m, uint8_t combine)
+{
+  if (combine == COMBINE_NONE) return 0;
+
+  uint32_t i;
+  Message *into = NULL;
+  for (i = 0; i < BUFSIZE; i++)
+  {
+    if (router->buffer[i] == NULL) break;
+    if (router->buffer[i]->address == m->address)
+    {
+      into = router->buffer[i];
+      break;
+    }
+  }
+  if (into == NULL) return 0;
+
+  /* Payloads are stored most significant byte first, which is the order they are delivered in, so the
+   * arithmetic modes walk the bytes from the back and the comparisons are plain lexicographic ones.
+   */
+  int32_t b;
+  uint16_t carry = 0;
+  int cmp = 0;
+  for (b = 0; b < MESSAGE_LENGTH && !cmp; b++) cmp = (int)m->message[b] - (int)into->message[b];
+
+  switch (combine)
+  {
+    case COMBINE_OR:
+      for (b = 0; b < MESSAGE_LENGTH; b++) into->message[b] |= m->message[b];
+      break;
+    case COMBINE_AND:
+      for (b = 0; b < MESSAGE_LENGTH; b++) into->message[b] &= m->message[b];
+      break;
+    case COMBINE_XOR:
+      for (b = 0; b < MESSAGE_LENGTH; b++) into->message[b] ^= m->message[b];
+      break;
+    case COMBINE_SUM: /* Wraps around like the bit serial adders on the cells would */
+      for (b = MESSAGE_LENGTH - 1; b >= 0; b--)
+      {
+        carry += into->message[b] + m->message[b];
+        into->message[b] = carry & 0xFF;
+        carry >>= 8;
+      }
+      break;
+    case COMBINE_MIN:
+      if (cmp < 0) for (b = 0; b < MESSAGE_LENGTH; b++) into->message[b] = m->message[b];
+      break;
+    case COMBINE_MAX:
+      if (cmp > 0) for (b = 0; b < MESSAGE_LENGTH; b++) into->message[b] = m->message[b];
+      break;
+    default:
+      return 0;
+  }
+
+  /* The parity was checked on injection, so regenerate it to match the new payload */
+  uint8_t parity = 0;
+  for (b = 0; b < MESSAGE_LENGTH; b++) parity ^= __builtin_parity(into->message[b]);
+  into->parity = parity;
+
+  free(m);
+  router->combined++;
+  return 1;
+}
+
 void router_forward(Router *router, uint32_t dimension)
 {
   /* First port of call is to determine which message will be forwarded. It should be the message
@@ -99,22 +177,28 @@ void router_forward(Router *router, uint32_t dimension)
  * to somehow refer it. I'll write that function later after some further architectural decisions
  */
 
-void router_receive(Router *router, uint32_t dim)
+void router_receive(Router *router, uint32_t dim, uint8_t combine)
 {
   Message *m = router->inports[dim];
   if (m == NULL) return; /* If no input message, there's nothing to do */
 
+  if (router_combine(router, m, combine))
+  {
+    router->inports[dim] = NULL;
+    return;
+  }
+
   //printf("recv ");
   uint8_t i = 0;
   while (i < BUFSIZE && router->buffer[i] != NULL) i++;
   //printf("%u\n", i);
-  if (i == BUFSIZE) router_refer(router, m); /* Buffer is full, need to refer */
+  if (i == BUFSIZE) router_refer(router, m, combine); /* Buffer is full, need to refer */
   else router->buffer[i] = m; /* Address switching has already been handled in the sending */
 
   router->inports[dim] = NULL; /* This function depends on inports being null if no message was sent! */
 }
 
-/* Message injection can managed by having each router have access to the flags of its associated
+/* Message injection can managed by having each router see the router data flags of its associated
  * processors. Messages will be sent from processors as a 1 as a handshake, followed by the router
  * address and the processor number (big endian), a 1 for formatting, the message, and finally a parity
  * bit. The router will check the parity on a fully received message.
@@ -126,45 +210,44 @@ void router_receive(Router *router, uint32_t dim)
  * processors. Each time the function is called it will read the appropriate bit and add it to the
  * message, and update the parity bit. On the final call of the injection cycle, it will check parity
  * and complete the handshake if the parity succeeded.
+ *
+ * The router doesn't touch the cells itself. The chip hands it the router data flag (flag 5) of all its
+ * processors at once, processor j at bit j of data, and the router hands back the processors whose
+ * handshake (flag 4) goes high. Every bit sent is only there for one cycle, so the chip then clears
+ * flag 5 on every processor - this simulates a hardware wire that will be zero unless actually being
+ * asserted.
  */
 
-void router_inject(Router *router, uint16_t bit) /*Messages up to ~64Ki, wayyy too big! */
+uint16_t router_inject(Router *router, uint16_t bit, uint16_t data, uint8_t combine)
 {
+  uint16_t i = 0;
+
   /* There is something special to do on bit 0 - this is the handshake 1. The router must decide which
    * messages to accept.
    */
   if (bit == 0)
   {
+    if (!data) return 0;
+
     /* First figure out how many messages we're willing to accept */
-    uint16_t i=0, accNo;
+    uint16_t accNo;
     while (i < BUFSIZE && ((router->buffer)[i] != NULL)) i++; /* Breaks when a null is found or i = 7 */
     accNo = BUFSIZE-i; /* This is the number of free spots */
     if (accNo > 4) accNo = 4; /* Accept max of 4 messages per petit cycle */
 
-    /* Now decide who we're accepting messages from by iterating over all the router flags and finding
-     * the first accNo willing to send */
+    /* Now decide who we're accepting messages from by taking the first accNo processors willing to send,
+     * lowest numbered first
+     */
     i = 0;
-    uint16_t j = 0;
-
-    while (i < accNo && j < (1 << PROCESSORS)) /* j counts the processors, index in flags */
+    while (i < accNo && data)
     {
-      /* Follow the pointers and extract the flag we want, see if it's a 1 */
-      uint16_t flags = *((router->flags)[j]); /* Value of all the flags in the proc */
+      (router->listening)[i] = __builtin_ctz(data); /* Mark the proc as listened to */
+      data &= data - 1;
 
-      /* Router data is flag 5, requires right shifting 10 and anding with 1 */
-      flags = (flags >> 10) & 1;
-
-      if (flags) /* The processor is trying to send a message. The router has space, so accept */
-      {
-        (router->listening)[i] = j; /* Mark proc j as listened to */
-
-        /* We need to create a partial message to be written into. Do this with calloc */
-        (router->partials)[i] = (Message*)calloc(1, sizeof(Message));
-        //printf("New message %u\n", router->partials[i]);
-        /* As they're all 0s, this is correct parity! Also increment i */
-        i++;
-      }
-      j++;
+      /* We need to create a partial message to be written into. Do this with calloc. As they're all 0s,
+       * this is correct parity!
+       */
+      (router->partials)[i++] = (Message*)calloc(1, sizeof(Message));
     }
 
     /* The router is accepting as many messages as it can, and partials are correctly set up. If less
@@ -173,24 +256,15 @@ void router_inject(Router *router, uint16_t bit) /*Messages up to ~64Ki, wayyy t
   }
 
   /* The next case is the router is sending the address on bits indexed from 1 to the length of the
-   * address. These need to be ored into the address field.
+   * address. These need to be ored into the address field, at ADDRLEN - bit as this whole thing is
+   * offset by 1 at this point.
    */
-  else if (bit < ADDRLEN + 1) /* +1 as this whole thing is offset by 1 at this point */
+  else if (bit < ADDRLEN + 1)
   {
-    uint16_t i = 0;
-    while (i < 4 && (router->partials)[i] != NULL)
+    for (; i < 4 && (router->partials)[i] != NULL; i++)
     {
-      /* First, extract the bit in question */
-      uint16_t flags = *((router->flags)[(router->listening)[i]]);
-      flags = (flags >> 10) & 1;
-
-      /* This needs to be shifted to the correct bit, which is basically ADDRLEN - bit - 1, and ored in
-       */
-      ((router->partials)[i])->address |= ((uint32_t)flags) << (ADDRLEN - bit);
-
-      i++;
+      ((router->partials)[i])->address |= (uint32_t)((data >> (router->listening)[i]) & 1) << (ADDRLEN - bit);
     }
-    /* And that's basically it for addresses. */
   }
 
   /* The next bit will always be a 1 in valid messages. Using a bit of fudging, we can set parity to 2
@@ -198,80 +272,49 @@ void router_inject(Router *router, uint16_t bit) /*Messages up to ~64Ki, wayyy t
    */
   else if (bit == ADDRLEN + 1)
   {
-    uint16_t i = 0;
-    while (i < 4 && (router->partials)[i] != NULL)
+    for (; i < 4 && (router->partials)[i] != NULL; i++)
     {
-      uint16_t flags = *((router->flags)[(router->listening)[i]]);
-      flags = (flags >> 10) & 1;
-
-      if (!flags) /* if this bit is a 0 */
-      {
-        ((router->partials)[i])->parity = 2;
-      }
-
-      i++;
+      if (!((data >> (router->listening)[i]) & 1)) ((router->partials)[i])->parity = 2;
     }
     /* Otherwise parity is 0 by default and we can do nothing */
   }
 
   /* It's a very similar ordeal for the message itself - read a bit, shift it right, and or it in - but
-   * there's a couple of extra things to deal with. Messages are stored in an array, and the parity bit
-   * needs dealing with by xoring in the bit itself
+   * messages are stored in an array, and the bit is also xored into the parity. The 2 extra bits are
+   * the initial 1 and the seperator 1.
    */
   else if (bit < ADDRLEN + (MESSAGE_LENGTH << 3) + 2)
-    /* The 2 extra bits are the initial 1 and the
-     * seperator 1
-     */
   {
-    uint16_t i = 0;
-    while (i < 4 && (router->partials[i] != NULL))
+    uint8_t byteOffset = (bit - ADDRLEN - 2) & 7;
+    for (; i < 4 && (router->partials[i] != NULL); i++)
     {
-      uint16_t flags = *((router->flags)[(router->listening)[i]]);
-      flags = (flags >> 10) & 1;
-
-      /* The position in the byte is determined by the last 3 bits of the bit number - the ADDRLEN + 2
-       * offset.
-       */
-      uint8_t byteOffset = (bit - ADDRLEN - 2) & 7;
-
-      /* The actual byte is determined by this number shifted 3 right. The assignment can be done in one
-       * fell swoop.
-       */
-      (((router->partials)[i])->message)[(bit - ADDRLEN - 2) >> 3] |= flags << (7 - byteOffset);
-
-      /* Also, xor the bit value into the parity bit */
-      ((router->partials)[i])->parity ^= flags;
-
-      i++;
-
-      /* This whole thing seems quite wasteful as it does a whole lotta nothing if the bit is 0, maybe
-       * should rewrite to only do this if the flag is 1? Will that jump be faster than the (presumably
-       * pretty fast) bit twiddling? Probably as we avoid writes.
-       */
+      uint8_t value = (data >> (router->listening)[i]) & 1;
+      (((router->partials)[i])->message)[(bit - ADDRLEN - 2) >> 3] |= value << (7 - byteOffset);
+      ((router->partials)[i])->parity ^= value;
     }
   }
 
   /* Finally, on the last bit received, we need to check parity. Assuming that's all good we set the
-   * handshake bit high. On the subsequent bit we just set the handshake bit low again.
+   * handshake bit high.
    */
   else if (bit == ADDRLEN + (MESSAGE_LENGTH << 3) + 2)
   {
-    uint16_t i = 0;
-    while (i < 4 && (router->partials[i] != NULL))
+    uint16_t ack = 0;
+    for (; i < 4 && (router->partials[i] != NULL); i++)
     {
-      uint16_t flags = *((router->flags)[(router->listening)[i]]);
-      flags = (flags >> 10) & 1;
-
-      if (flags == (uint16_t)((router->partials)[i])->parity)
+      if (((data >> (router->listening)[i]) & 1) == ((router->partials)[i])->parity)
       {
-        /* Set the handshake bit to high */
-        *((router->flags)[(router->listening)[i]]) |= 1 << 11;
-
-        /* Then add the finished partial into the next open space in the buffer */
-        uint8_t j = 0;
-        while ((router->buffer)[j]) j++;
-        (router->buffer)[j] = (router->partials)[i];
-        (router->partials)[i] = NULL;
+        ack |= 1 << (router->listening)[i];
+
+        /* Then add the finished partial into the next open space in the buffer, unless it can be
+         * combined with one already there
+         */
+        if (!router_combine(router, (router->partials)[i], combine))
+        {
+          uint8_t j = 0;
+          while ((router->buffer)[j]) j++;
+          (router->buffer)[j] = (router->partials)[i];
+        }
       }
       /* Else, something has gone wrong and we don't complete the handshake, act as if the message never
        * happened. BUT the broken message needs to be deleted with free!
@@ -279,32 +322,21 @@ void router_inject(Router *router, uint16_t bit) /*Messages up to ~64Ki, wayyy t
       else
       {
         free((router->partials)[i]);
+        router->parityFailed++;
       }
 
       (router->partials)[i] = NULL;
-      i++;
     }
+    return ack;
   }
 
-  else if (bit == ADDRLEN + (MESSAGE_LENGTH << 3) + 3)
-  {
-    /* In this case, simply set every processor's handshake flag to low */
-    for (uint32_t j = 0; j < (1 << PROCESSORS); j++)
-    {
-      *((router->flags)[j]) |= ~(1 << 11);
-    }
-  }
-
-  /* Finally, reset the bit to zero by default - this simulates a hardware wire that will be zero
-   * unless actually being asserted
-   */
-
-  for (uint32_t j = 0; j < (1 << PROCESSORS); j++) *((router->flags)[j]) &= ~(1 << 10);
+  return 0;
 }
 
 /* To deliver messages we can do a similar thing to sending them, except now we only care about the
  * payload. Each iteration, we iterate over all 7 messages and deliver the appropiate bit to the right
- * processor when the address is 0.
+ * processor when the address is 0. The bits go back to the chip in the same way as injection, processor
+ * j at bit j, and it writes them into flag 5.
  *
  * Notably the connection machine provides 2 methods for sending multiple messages to processors -
  * just oring them together or delivering one in each cycle. To allow this to work, The algorithm will
@@ -313,14 +345,11 @@ void router_inject(Router *router, uint16_t bit) /*Messages up to ~64Ki, wayyy t
  * delivering (not that the parity bit has much meaning in that case!)
  */
 
-void router_deliver(Router *router, uint16_t bit, uint8_t shouldOr)
+uint16_t router_deliver(Router *router, uint16_t bit, uint8_t shouldOr)
 {
-
   uint32_t i;
-  uint16_t deliverBits[1 << PROCESSORS];
-  for (i = 0; i < (1 << PROCESSORS); i++) deliverBits[i] = 0; /* Initialise the array to zeroes, deliver
-                                                               * 0 by default!
-                                                               */
+  uint16_t deliverBits = 0; /* Deliver 0 by default! */
+
   /* Extract the processor address mask. This is the number of processors - 1. Special case if there
   * are 2**32 procs per router, need to set mask definitively to prevent underflow.
   */
@@ -341,9 +370,9 @@ void router_deliver(Router *router, uint16_t bit, uint8_t shouldOr)
   {
     for (i = 0; i < BUFSIZE; i++)
     {
-      if (router->buffer[i] == NULL) {/*printf("%u", i);*/ break;}
+      if (router->buffer[i] == NULL) break;
       if (router->buffer[i]->address >> PROCESSORS != 0) continue; /* Message for different router */
-      deliverBits[router->buffer[i]->address & procMask] = 1;
+      deliverBits |= 1 << (router->buffer[i]->address & procMask);
     }
   }
   /* For bits then up to the length of the message, we can just read that bit - 1 of the message and
@@ -354,97 +383,70 @@ void router_deliver(Router *router, uint16_t bit, uint8_t shouldOr)
   {
     for (i = 0; i < BUFSIZE; i++)
     {
-      if (router->buffer[(BUFSIZE - 1) -i] == NULL) continue;
-      if (router->buffer[(BUFSIZE - 1) -i]->address >> PROCESSORS != 0) continue;
-      /* 6-i is populated. Extract the bit */
-      uint8_t msgVal = router->buffer[BUFSIZE-1-i]->message[(bit - 1) >> 3];
-      msgVal = (msgVal >> (7 - ((bit - 1) & 7))) & 1; /* This is the actual bit now! */
+      Message *m = router->buffer[(BUFSIZE - 1) - i];
+      if (m == NULL) continue;
+      if (m->address >> PROCESSORS != 0) continue;
+      /* Extract the bit */
+      uint16_t msgVal = (m->message[(bit - 1) >> 3] >> (7 - ((bit - 1) & 7))) & 1;
 
       /* Now how we write it depends on the mode */
-      if (shouldOr) deliverBits[(router->buffer[BUFSIZE - 1 -i]->address) & procMask] |= msgVal;
-      else deliverBits[(router->buffer[BUFSIZE-1-i]->address) & procMask] = msgVal;
+      uint16_t proc = m->address & procMask;
+      if (shouldOr) deliverBits |= msgVal << proc;
+      else deliverBits = (deliverBits & ~(1 << proc)) | (msgVal << proc);
     }
   }
-  /* Finally, the case where it's the parity bit. Here, just worry about delivering the bit - we'll free
-   * the messages and sort out the buffer after delivering so we can reuse deliverBits if necessary!
+  /* Finally, the case where it's the parity bit. I'm lazy and not using the parity bit anyway, so every
+   * processor gets a 0, and the spent messages are deleted and the buffer sorted out.
    */
   else if (bit == (MESSAGE_LENGTH << 3) + 1)
   {
-    //printf("cringe\n");
-    for (i = 0; i < BUFSIZE; i++)
-    {
-      if (router->buffer[BUFSIZE-1-i] == NULL) continue;
-      if (router->buffer[BUFSIZE-1-i]->address >> PROCESSORS != 0) continue;
-      uint8_t msgVal = router->buffer[BUFSIZE-1-i]->parity;
-      //printf("beans\n");
-
-      if (shouldOr) deliverBits[router->buffer[BUFSIZE-1-i]->address & procMask] |= msgVal;
-      else deliverBits[router->buffer[BUFSIZE-1-i]->address & procMask] = msgVal;
-      //I'm lazy and not using the parity bit anyway.
-      deliverBits[router->buffer[BUFSIZE-1-i]->address & procMask] = 0;
-    }
+    Message *retired[BUFSIZE];
+    uint32_t n = router_retire(router, shouldOr, retired);
+    for (i = 0; i < n; i++) free(retired[i]);
   }
 
-  /* Now the bits can actually be delivered to the appropiate processors. */
-  for (i = 0; i < (1 << PROCESSORS); i++)
+  /* And that's delivery done! */
+  return deliverBits;
+}
+
+/* Takes the messages that have just been delivered out of the buffer: in or mode that's every message
+ * for this router, otherwise only the earliest for each processor. They're moved into retired, which
+ * needs room for BUFSIZE, rather than freed, and the survivors are packed down. Returns how many.
+ */
+uint32_t router_retire(Router *router, uint8_t shouldOr, Message **retired)
+{
+  uint32_t i, n = 0;
+  uint32_t procMask = (PROCESSORS == 32) ? (uint32_t)-1 : (uint32_t)(1 << PROCESSORS) - 1;
+  uint8_t taken[1 << PROCESSORS];
+
+  /* If we're in or mode this is easy - take any msg with router address 0. Otherwise we mark off each
+   * processor as its first message is taken.
+   */
+  for (i = 0; i < (1 << PROCESSORS); i++) taken[i] = 0;
+  for (i = 0; i < BUFSIZE; i++)
   {
-    if (deliverBits[i]) /* == 1 */
-    {
-      *(router->flags[i]) |= 1 << 10;
-    }
-    else /* == 0 */
+    Message *m = router->buffer[i];
+    if (m == NULL || (m->address >> PROCESSORS) != 0) continue;
+    if (!shouldOr)
     {
-      *(router->flags[i]) &= ~(1 << 10);
+      if (taken[m->address & procMask]) continue;
+      taken[m->address & procMask] = 1;
     }
+    retired[n++] = m;
+    router->buffer[i] = NULL;
   }
+  router->delivered += n;
 
-  /* Finally, if it's the parity bit, delete all the spent messages and fix the buffer */
-  if (bit == (MESSAGE_LENGTH << 3) + 1)
+  /* Now we can shift the buffer down to remove the NULLs. Several neighbouring messages can be taken at
+   * once, so pack the survivors down in one pass rather than shifting per hole.
+   */
+  uint8_t j = 0;
+  for (i = 0; i < BUFSIZE; i++)
   {
-    /* If we're in or mode deleting is easy - just delete any msg with router address 0 */
-    if (shouldOr)
-    {
-      for (i = 0; i < BUFSIZE; i++)
-      {
-        if ((router->buffer[i]->address) >> PROCESSORS == 0)
-        {
-          free(router->buffer[i]);
-          router->buffer[i] = NULL;
-        }
-      }
-    }
-    /* Otherwise, this takes a bit more thinking. We reuse the deliverBits array, initially setting
-     * everything to 1, then setting to 0 when a message with that processor is freed
-     */
-    else
-    {
-      for (i = 0; i < (1 << PROCESSORS); i++) deliverBits[i] = 1;
-      for (i = 0; i < BUFSIZE; i++)
-      {
-	if (router->buffer[i] == NULL) continue;
-        if (((router->buffer[i]->address) >> PROCESSORS == 0)
-          && deliverBits[router->buffer[i]->address & procMask])
-        {
-	  //printf("\nGot here %u\n", i);
-          deliverBits[router->buffer[i]->address & procMask] = 0;
-          free(router->buffer[i]);
-          router->buffer[i] = NULL;
-        }
-      }
-    }
-    /* Now we can shift the buffer down to remove the NULLs */
-    uint8_t j;
-    for (i = 0; i < BUFSIZE; i++)
-    {
-      if (router->buffer[i] == NULL)
-      {
-        for (j = i; j < BUFSIZE-1; j++) router->buffer[j] = router->buffer[j+1];
-        router->buffer[BUFSIZE-1] = NULL;
-      }
-    }
+    if (router->buffer[i] != NULL) router->buffer[j++] = router->buffer[i];
   }
-
-  /* And that's delivery done! */
+  for (; j < BUFSIZE; j++) router->buffer[j] = NULL;
+  return n;
 }
 
 int router_empty(Router *router)
@@ -3,12 +3,32 @@
 
 #include <stdint.h>
 
+#ifndef DIMENSIONS /* Can be set smaller when building, for quick experiments */
 #define DIMENSIONS 12
+#endif
+/* The NEWS grid lays the chips out in a square, so it takes an even number of dimensions. Nothing has
+ * been tried with fewer than four chips.
+ */
+#if DIMENSIONS % 2 || DIMENSIONS < 2
+#error "DIMENSIONS has to be even and at least 2"
+#endif
 #define PROCESSORS  4 /* log_2 of the number of processors associated with 1 router */
 #define MESSAGE_LENGTH 4 /* message length in bytes*/
 #define ADDRLEN (DIMENSIONS + PROCESSORS)
 #define BUFSIZE 7
 
+/* Combining modes. When a mode other than COMBINE_NONE is selected, two messages for the same
+ * processor that meet in a router buffer are merged into one, with the payloads treated as big endian
+ * unsigned integers for SUM, MIN and MAX.
+ */
+#define COMBINE_NONE 0
+#define COMBINE_OR 1
+#define COMBINE_AND 2
+#define COMBINE_XOR 3
+#define COMBINE_SUM 4
+#define COMBINE_MIN 5
+#define COMBINE_MAX 6
+
 typedef struct
 {
   uint32_t address; /* least sig PROCESSORS bits are within a router, next least sig DIM bits for router */
@@ -23,18 +43,27 @@ typedef struct rint
   Message *buffer[BUFSIZE];
   uint32_t listening[4];
   Message *partials[4];
-  uint16_t *flags[1 << PROCESSORS];
   struct rint *referer;
   uint32_t id;
+  uint32_t combined; /* Number of messages merged into another by combining */
+  uint32_t referred; /* Number of messages sent elsewhere because the buffer was full */
+  uint32_t parityFailed; /* Number of injected messages thrown away for bad parity */
+  uint32_t delivered; /* Number of messages handed to this router's processors */
 } Router;
 
 void router_forward(Router *router, uint32_t dimension);
 
-void router_inject(Router *router, uint16_t bit);
+/* Processor j's flag 5 is bit j of data. Returns the processors whose handshake goes high */
+uint16_t router_inject(Router *router, uint16_t bit, uint16_t data, uint8_t combine);
+
+/* Returns the bit delivered to each processor, processor j at bit j */
+uint16_t router_deliver(Router *router, uint16_t bit, uint8_t shouldOr);
+
+void router_receive(Router *router, uint32_t dim, uint8_t combine);
 
-void router_deliver(Router *router, uint16_t bit, uint8_t shouldOr);
+int router_combine(Router *router, Message *m, uint8_t combine);
 
-void router_receive(Router *router, uint32_t dim);
+uint32_t router_retire(Router *router, uint8_t shouldOr, Message **retired);
 
 int router_empty(Router *router);
 
@@ -0,0 +1,38 @@
+#include "connection_machine.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Runs a trace recorded with cm_trace_start on a fresh machine as fast as it will go, and checks the
+ * final state against the recording. Build it alongside the library sources, e.g.
+ *
+ *   gcc -O2 -Isrc tools/cm_replay.c $(ls src/[a-z]*.c | grep -v cm_dump.c) -lpthread -o cm_replay
+ */
+
+int main(int argc, char **argv)
+{
+  if (argc != 2)
+  {
+    printf("Usage: %s trace\n", argv[0]);
+    return 2;
+  }
+
+  cm *machine = cm_build();
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int result = cm_replay(machine, argv[1]);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  if (result < 0) printf("Couldn't read a complete trace from %s\n", argv[1]);
+  else
+  {
+    printf("%u cycles in %.3fs (%.0f ns per cycle)\n", machine->cycle, seconds,
+           machine->cycle ? seconds * 1e9 / machine->cycle : 0.0);
+    printf("Final state %s the recording\n", result ? "DOES NOT MATCH" : "matches");
+  }
+
+  cm_del(machine);
+  return result ? 1 : 0;
+}
@@ -0,0 +1,266 @@
+#include "connection_machine.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* Checks the message level router model against the accurate engine. The same random traffic is pushed
+ * through both, with the accurate machine driven bit by bit from the host the way a program would drive
+ * it - offering each message on the router data flag and offering it again next petit cycle if it isn't
+ * acknowledged - and every delivery it sees is compared with what cm_msgnet reports. A small machine
+ * keeps the accurate side quick, e.g.
+ *
+ *   gcc -O2 -DDIMENSIONS=6 -Isrc tools/msgnet_check.c $(ls src/[a-z]*.c | grep -v cm_dump.c) -lpthread \
+ *       -o msgnet_check
+ *   ./msgnet_check 2000 20 fast hipri 0 1
+ *
+ * Arguments are the number of messages, how many petit cycles to spread their sending over, fast or slow,
+ * or or hipri, the combining mode and a seed. Exits with 0 if the two agree.
+ */
+
+#define CHECK_CELLS (1 << (DIMENSIONS + PROCESSORS))
+
+typedef struct
+{
+  uint32_t source;
+  uint32_t dest;
+  uint32_t start; /* Petit cycle it's first offered on */
+  uint8_t message[MESSAGE_LENGTH];
+} check_message;
+
+static uint32_t seed;
+static uint32_t check_rand()
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+static int delivery_order(const void *a, const void *b)
+{
+  const cm_delivery *x = (const cm_delivery *)a, *y = (const cm_delivery *)b;
+  if (x->cycle != y->cycle) return (x->cycle < y->cycle) ? -1 : 1;
+  if (x->dest != y->dest) return (x->dest < y->dest) ? -1 : 1;
+  return memcmp(x->message, y->message, MESSAGE_LENGTH);
+}
+
+/* In or mode the accurate engine hands a processor the or of everything for it, so fold the model's
+ * deliveries the same way. Expects them sorted.
+ */
+static uint32_t fold_or(cm_delivery *d, uint32_t count)
+{
+  uint32_t i, out = 0, b;
+  for (i = 0; i < count; i++)
+  {
+    if (out && d[out - 1].cycle == d[i].cycle && d[out - 1].dest == d[i].dest)
+    {
+      for (b = 0; b < MESSAGE_LENGTH; b++) d[out - 1].message[b] |= d[i].message[b];
+    }
+    else d[out++] = d[i];
+  }
+  return out;
+}
+
+/* The bit a message puts on the router data flag at injection cycle bit */
+static uint8_t stream_bit(check_message *m, uint32_t bit)
+{
+  uint32_t address = (((m->dest >> PROCESSORS) ^ (m->source >> PROCESSORS)) << PROCESSORS)
+                     | (m->dest & ((1 << PROCESSORS) - 1));
+  uint8_t parity = 0;
+  uint32_t b;
+  if (bit == 0 || bit == ADDRLEN + 1) return 1;
+  if (bit <= ADDRLEN) return (address >> (ADDRLEN - bit)) & 1;
+  if (bit < ADDRLEN + (MESSAGE_LENGTH << 3) + 2)
+  {
+    b = bit - ADDRLEN - 2;
+    return (m->message[b >> 3] >> (7 - (b & 7))) & 1;
+  }
+  for (b = 0; b < MESSAGE_LENGTH; b++) parity ^= __builtin_parity(m->message[b]);
+  return parity;
+}
+
+static double seconds_since(struct timespec *start)
+{
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc != 7)
+  {
+    printf("Usage: %s messages spread fast|slow or|hipri combine seed\n", argv[0]);
+    return 2;
+  }
+  uint32_t count = atoi(argv[1]), spread = atoi(argv[2]), i, j;
+  uint8_t slow = !strcmp(argv[3], "slow"), orMode = !strcmp(argv[4], "or"), combine = atoi(argv[5]);
+  seed = atoi(argv[6]) | 1;
+  if (spread == 0 || combine > COMBINE_MAX) return 2;
+
+  /* Messages sorted by when they start, so both sides can pick them up in order */
+  check_message *messages = (check_message *)malloc(count * sizeof(check_message));
+  for (i = 0; i < count; i++)
+  {
+    messages[i].start = i * spread / count;
+    messages[i].source = check_rand() % CHECK_CELLS;
+    messages[i].dest = check_rand() % CHECK_CELLS;
+    for (j = 0; j < MESSAGE_LENGTH; j++) messages[i].message[j] = check_rand();
+  }
+
+  /* The model */
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  cm_msgnet *n = cm_msgnet_build(orMode, slow, combine);
+  uint32_t next = 0;
+  while (next < count || cm_msgnet_busy(n))
+  {
+    for (; next < count && messages[next].start == n->petit; next++)
+    {
+      cm_msgnet_send(n, messages[next].source, messages[next].dest, messages[next].message);
+    }
+    cm_msgnet_petit(n);
+  }
+  double modelTime = seconds_since(&start);
+
+  /* The accurate engine. Each cell has a queue of messages to send, as indices into messages. */
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  cm *machine = cm_build();
+  if (orMode) shouldOr(machine);
+  else shouldntOr(machine);
+  if (slow) slowMode(machine);
+  combineMode(machine, combine);
+
+  uint32_t *queue = (uint32_t *)malloc(count * sizeof(uint32_t));
+  uint32_t *queueNext = (uint32_t *)malloc(count * sizeof(uint32_t));
+  int64_t *heads = (int64_t *)malloc(CHECK_CELLS * sizeof(int64_t));
+  int64_t *tails = (int64_t *)malloc(CHECK_CELLS * sizeof(int64_t));
+  uint8_t *receiving = (uint8_t *)calloc(CHECK_CELLS, 1);
+  uint8_t (*payload)[MESSAGE_LENGTH] = calloc(CHECK_CELLS, MESSAGE_LENGTH);
+  cm_delivery *seen = NULL;
+  uint32_t seenCount = 0, seenCapacity = 0, waiting = 0, petit = 0;
+  uint32_t deliverAt = INJECT_CYCLES + DIMENSIONS * DIMENSION_CYCLES(slow);
+  for (i = 0; i < CHECK_CELLS; i++) heads[i] = tails[i] = -1;
+  for (i = 0; i < count; i++) queue[i] = i;
+
+  next = 0;
+  while (next < count || waiting || network_empty(machine))
+  {
+    for (; next < count && messages[next].start == petit; next++)
+    {
+      uint32_t s = messages[next].source;
+      queueNext[next] = (uint32_t)-1;
+      if (tails[s] >= 0) queueNext[tails[s]] = next;
+      else heads[s] = next;
+      tails[s] = next;
+      waiting++;
+    }
+    for (i = 0; i < CHECK_CELLS; i++)
+    {
+      machine->chips[i >> PROCESSORS]->cells[i & ((1 << PROCESSORS) - 1)]->flags &= ~(1 << 11);
+    }
+
+    uint32_t bit;
+    for (bit = 0; bit < PETIT_LENGTH(slow); bit++)
+    {
+      if (bit < INJECT_CYCLES)
+      {
+        for (i = 0; i < CHECK_CELLS; i++)
+        {
+          if (heads[i] < 0) continue;
+          Cell *c = machine->chips[i >> PROCESSORS]->cells[i & ((1 << PROCESSORS) - 1)];
+          if (stream_bit(&messages[heads[i]], bit)) c->flags |= 1 << 10;
+        }
+      }
+      cm_exe(machine, 0, 0, 0, 0, 0, 0, IDM, IDF, 0);
+
+      /* Acknowledged messages are done with; anything else is offered again next time */
+      if (bit == INJECT_CYCLES - 1)
+      {
+        for (i = 0; i < CHECK_CELLS; i++)
+        {
+          if (heads[i] < 0) continue;
+          if (!((machine->chips[i >> PROCESSORS]->cells[i & ((1 << PROCESSORS) - 1)]->flags >> 11) & 1))
+          {
+            continue;
+          }
+          heads[i] = queueNext[heads[i]];
+          if (heads[i] == (uint32_t)-1) heads[i] = tails[i] = -1;
+          waiting--;
+        }
+      }
+
+      /* Deliveries start with a handshake 1, then the payload follows a bit a cycle */
+      if (bit >= deliverAt && bit <= deliverAt + (MESSAGE_LENGTH << 3))
+      {
+        for (i = 0; i < CHECK_CELLS; i++)
+        {
+          uint8_t v = (machine->chips[i >> PROCESSORS]->cells[i & ((1 << PROCESSORS) - 1)]->flags >> 10) & 1;
+          uint32_t b = bit - deliverAt - 1;
+          if (bit == deliverAt)
+          {
+            receiving[i] = v;
+            memset(payload[i], 0, MESSAGE_LENGTH);
+          }
+          else if (receiving[i]) payload[i][b >> 3] |= v << (7 - (b & 7));
+        }
+      }
+      if (bit == deliverAt + (MESSAGE_LENGTH << 3))
+      {
+        for (i = 0; i < CHECK_CELLS; i++)
+        {
+          if (!receiving[i]) continue;
+          if (seenCount == seenCapacity)
+          {
+            seenCapacity = seenCapacity ? seenCapacity * 2 : 1024;
+            seen = (cm_delivery *)realloc(seen, seenCapacity * sizeof(cm_delivery));
+          }
+          seen[seenCount].dest = i;
+          seen[seenCount].cycle = petit * PETIT_LENGTH(slow) + deliverAt;
+          memcpy(seen[seenCount].message, payload[i], MESSAGE_LENGTH);
+          seenCount++;
+        }
+      }
+    }
+    petit++;
+  }
+  double accurateTime = seconds_since(&start);
+
+  /* Compare the two, delivery by delivery, and the router counters */
+  qsort(seen, seenCount, sizeof(cm_delivery), delivery_order);
+  qsort(n->deliveries, n->deliveryCount, sizeof(cm_delivery), delivery_order);
+  uint32_t modelCount = orMode ? fold_or(n->deliveries, n->deliveryCount) : n->deliveryCount;
+  uint32_t referred = 0, combined = 0, mismatches = 0;
+  for (i = 0; i < (1 << DIMENSIONS); i++)
+  {
+    referred += machine->chips[i]->router->referred;
+    combined += machine->chips[i]->router->combined;
+  }
+  for (i = 0; i < seenCount || i < modelCount; i++)
+  {
+    if (i < seenCount && i < modelCount && !delivery_order(&seen[i], &(n->deliveries[i]))) continue;
+    if (mismatches++ < 10)
+    {
+      printf("Delivery %u differs: accurate ", i);
+      if (i < seenCount) printf("cell %u cycle %u", seen[i].dest, seen[i].cycle);
+      else printf("none");
+      printf(", model ");
+      if (i < modelCount) printf("cell %u cycle %u\n", n->deliveries[i].dest, n->deliveries[i].cycle);
+      else printf("none\n");
+    }
+  }
+
+  printf("%u messages over %u petit cycles, %u deliveries, %u referred, %u combined\n", count, petit,
+         seenCount, referred, combined);
+  printf("Accurate %.3fs, model %.3fs (%.1fx)\n", accurateTime, modelTime, accurateTime / modelTime);
+  if (mismatches || referred != cm_msgnet_referred(n) || combined != cm_msgnet_combined(n) || petit != n->petit)
+  {
+    printf("MISMATCH: %u deliveries differ, model took %u petit cycles with %u referred, %u combined\n",
+           mismatches, n->petit, cm_msgnet_referred(n), cm_msgnet_combined(n));
+    return 1;
+  }
+  printf("Match\n");
+  return 0;
+}
@@ -0,0 +1,274 @@
+#include "connection_machine.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* Benchmarks the router network on its own. Standard traffic patterns are pushed through the accurate
+ * engine's routers - router_inject, router_forward, router_receive and router_deliver by way of chip_route
+ * and chip_recv - without running any cells, with the host playing each sender's part on the router data
+ * flag and offering a message again each petit cycle until it's acknowledged. Every pattern runs in
+ * or and hipri mode, fast and slow, and the results come out as JSON:
+ *
+ *   ns_per_petit        host time spent in the routers per petit cycle
+ *   messages_per_second messages delivered per second of that time
+ *   latency_*           cycles from a message first being offered to its handshake bit arriving
+ *   referred            messages referred for want of buffer space
+ *
+ * Build it alongside the library sources, e.g.
+ *
+ *   gcc -O2 -Isrc tools/router_bench.c $(ls src/[a-z]*.c | grep -v cm_dump.c) -lpthread -o router_bench
+ *   ./router_bench 4096 1 > baseline.json
+ *
+ * The arguments are the number of messages per pattern (all-to-one sends a sixteenth as many, as they
+ * can only be delivered one a petit cycle) and a seed.
+ */
+
+#define BENCH_CELLS (1 << (DIMENSIONS + PROCESSORS))
+#define BENCH_BITS (DIMENSIONS + PROCESSORS)
+
+#define PATTERN_UNIFORM 0
+#define PATTERN_BITREV 1
+#define PATTERN_TRANSPOSE 2
+#define PATTERN_HOTSPOT 3
+#define PATTERN_ALLTOONE 4
+#define PATTERN_NEIGHBOUR 5
+#define PATTERNS 6
+
+static const char *patternNames[PATTERNS] = {"uniform", "bitrev", "transpose", "hotspot", "alltoone",
+                                             "neighbour"};
+
+typedef struct
+{
+  uint32_t source;
+  uint32_t dest;
+  uint32_t offered; /* Cycle it was first offered on */
+  uint32_t next; /* The source's next message */
+} bench_message;
+
+static uint32_t seed;
+static uint32_t bench_rand()
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+static uint32_t bench_dest(uint8_t pattern, uint32_t source)
+{
+  uint32_t i, d = 0;
+  switch (pattern)
+  {
+    case PATTERN_BITREV:
+      for (i = 0; i < BENCH_BITS; i++) d |= ((source >> i) & 1) << (BENCH_BITS - 1 - i);
+      return d;
+    case PATTERN_TRANSPOSE: /* Swap the top and bottom halves of the address */
+      return ((source << (BENCH_BITS >> 1)) | (source >> (BENCH_BITS - (BENCH_BITS >> 1))))
+             & (BENCH_CELLS - 1);
+    case PATTERN_HOTSPOT: /* A tenth of everything goes to cell 0 */
+      return (bench_rand() % 10 == 0) ? 0 : bench_rand() % BENCH_CELLS;
+    case PATTERN_ALLTOONE:
+      return 0;
+    case PATTERN_NEIGHBOUR: /* The same cell on a chip one hop away */
+      return source ^ (1 << (PROCESSORS + bench_rand() % DIMENSIONS));
+    default:
+      return bench_rand() % BENCH_CELLS;
+  }
+}
+
+/* The bit a message puts on the router data flag at injection cycle bit. The payload is the message's
+ * index, so deliveries can be matched back up.
+ */
+static uint8_t stream_bit(bench_message *m, uint32_t index, uint32_t bit)
+{
+  uint32_t address = (((m->dest >> PROCESSORS) ^ (m->source >> PROCESSORS)) << PROCESSORS)
+                     | (m->dest & ((1 << PROCESSORS) - 1));
+  if (bit == 0 || bit == ADDRLEN + 1) return 1;
+  if (bit <= ADDRLEN) return (address >> (ADDRLEN - bit)) & 1;
+  if (bit < ADDRLEN + (MESSAGE_LENGTH << 3) + 2) return (index >> (ADDRLEN + 33 - bit)) & 1;
+  return __builtin_parity(index);
+}
+
+static uint64_t bench_now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static int latency_order(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+static Cell *bench_cell(cm *machine, uint32_t cell)
+{
+  return machine->chips[cell >> PROCESSORS]->cells[cell & ((1 << PROCESSORS) - 1)];
+}
+
+static void bench_run(uint8_t pattern, uint8_t orMode, uint8_t slow, uint32_t count, uint32_t base,
+                      uint8_t first)
+{
+  seed = base; /* The same traffic in every mode */
+  cm *machine = cm_build();
+  bench_message *messages = (bench_message *)malloc(count * sizeof(bench_message));
+  int64_t *heads = (int64_t *)malloc(BENCH_CELLS * sizeof(int64_t));
+  int64_t *tails = (int64_t *)malloc(BENCH_CELLS * sizeof(int64_t));
+  uint32_t *latencies = (uint32_t *)malloc(count * sizeof(uint32_t));
+  Message **before = (Message **)malloc((1 << DIMENSIONS) * BUFSIZE * sizeof(Message *));
+  uint32_t *beforeIds = (uint32_t *)malloc((1 << DIMENSIONS) * BUFSIZE * sizeof(uint32_t));
+  uint32_t *beforeRouters = (uint32_t *)malloc((1 << DIMENSIONS) * BUFSIZE * sizeof(uint32_t));
+  uint32_t i, j, r, waiting = count, delivered = 0, petit = 0, cycle = 0;
+  uint64_t routerTime = 0;
+
+  /* Senders are spread evenly over the machine, and all start at once */
+  for (i = 0; i < BENCH_CELLS; i++) heads[i] = tails[i] = -1;
+  for (i = 0; i < count; i++)
+  {
+    bench_message *m = &messages[i];
+    m->source = (uint32_t)((uint64_t)i * BENCH_CELLS / count);
+    m->dest = bench_dest(pattern, m->source);
+    m->offered = UINT32_MAX;
+    m->next = UINT32_MAX;
+    if (tails[m->source] >= 0) messages[tails[m->source]].next = i;
+    else heads[m->source] = i;
+    tails[m->source] = i;
+  }
+
+  uint32_t deliverAt = INJECT_CYCLES + DIMENSIONS * DIMENSION_CYCLES(slow);
+  uint32_t retireAt = deliverAt + (MESSAGE_LENGTH << 3) + 1;
+  while (delivered < count)
+  {
+    for (i = 0; i < BENCH_CELLS; i++)
+    {
+      bench_cell(machine, i)->flags &= ~(1 << 11);
+      if (heads[i] >= 0 && messages[heads[i]].offered == UINT32_MAX) messages[heads[i]].offered = cycle;
+    }
+
+    uint32_t bit;
+    for (bit = 0; bit < PETIT_LENGTH(slow); bit++, cycle++)
+    {
+      if (bit < INJECT_CYCLES)
+      {
+        for (i = 0; i < BENCH_CELLS; i++)
+        {
+          if (heads[i] >= 0 && stream_bit(&messages[heads[i]], heads[i], bit))
+          {
+            bench_cell(machine, i)->flags |= 1 << 10;
+          }
+        }
+      }
+
+      /* Delivered messages are the ones addressed here that are gone once the parity bit is delivered.
+       * Only their payloads are needed afterwards, so note those down now.
+       */
+      uint32_t beforeCount = 0;
+      if (bit == retireAt)
+      {
+        for (r = 0; r < (1 << DIMENSIONS); r++)
+        {
+          Router *router = machine->chips[r]->router;
+          for (j = 0; j < BUFSIZE; j++)
+          {
+            Message *m = router->buffer[j];
+            if (m == NULL || (m->address >> PROCESSORS) != 0) continue;
+            uint32_t index = 0, b;
+            for (b = 0; b < MESSAGE_LENGTH; b++) index = (index << 8) | m->message[b];
+            before[beforeCount] = m;
+            beforeRouters[beforeCount] = r;
+            beforeIds[beforeCount++] = index;
+          }
+        }
+      }
+
+      uint64_t start = bench_now();
+      for (r = 0; r < (1 << DIMENSIONS); r++)
+      {
+        chip_route(machine->chips[r], bit, orMode, slow, COMBINE_NONE);
+      }
+      for (r = 0; r < (1 << DIMENSIONS); r++)
+      {
+        chip_recv(machine->chips[r], bit, slow, COMBINE_NONE);
+      }
+      routerTime += bench_now() - start;
+
+      if (bit == INJECT_CYCLES - 1)
+      {
+        for (i = 0; i < BENCH_CELLS; i++)
+        {
+          if (heads[i] < 0 || !((bench_cell(machine, i)->flags >> 11) & 1)) continue;
+          heads[i] = (messages[heads[i]].next == UINT32_MAX) ? -1 : (int64_t)messages[heads[i]].next;
+          if (heads[i] < 0) tails[i] = -1;
+          waiting--;
+        }
+      }
+
+      if (bit == retireAt)
+      {
+        for (j = 0; j < beforeCount; j++)
+        {
+          /* Delivery doesn't move messages between routers, so only the one it was in needs looking at */
+          Router *router = machine->chips[beforeRouters[j]]->router;
+          uint8_t still = 0;
+          for (i = 0; i < BUFSIZE; i++) if (router->buffer[i] == before[j]) still = 1;
+          if (still) continue;
+          latencies[delivered++] = petit * PETIT_LENGTH(slow) + deliverAt - messages[beforeIds[j]].offered;
+        }
+      }
+    }
+    petit++;
+  }
+
+  uint32_t referred = 0;
+  for (r = 0; r < (1 << DIMENSIONS); r++) referred += machine->chips[r]->router->referred;
+  qsort(latencies, count, sizeof(uint32_t), latency_order);
+
+  printf("%s  {\"pattern\": \"%s\", \"mode\": \"%s\", \"speed\": \"%s\", \"messages\": %u, \"petits\": %u, "
+         "\"ns_per_petit\": %.0f, \"messages_per_second\": %.0f, \"latency_p50\": %u, \"latency_p90\": %u, "
+         "\"latency_p99\": %u, \"latency_max\": %u, \"referred\": %u}", first ? "" : ",\n",
+         patternNames[pattern], orMode ? "or" : "hipri", slow ? "slow" : "fast", count, petit,
+         (double)routerTime / petit, count / (routerTime / 1e9), latencies[count / 2],
+         latencies[(uint64_t)count * 9 / 10], latencies[(uint64_t)count * 99 / 100], latencies[count - 1],
+         referred);
+  fflush(stdout);
+
+  free(messages);
+  free(heads);
+  free(tails);
+  free(latencies);
+  free(before);
+  free(beforeIds);
+  free(beforeRouters);
+  cm_del(machine);
+}
+
+int main(int argc, char **argv)
+{
+  uint32_t count = (argc > 1) ? atoi(argv[1]) : 4096;
+  uint32_t base = ((argc > 2) ? atoi(argv[2]) : 1) | 1;
+  if (count < 16 || count > BENCH_CELLS)
+  {
+    printf("Usage: %s [messages, 16 to %u] [seed]\n", argv[0], BENCH_CELLS);
+    return 2;
+  }
+
+  uint8_t pattern, orMode, slow, first = 1;
+  printf("[\n");
+  for (pattern = 0; pattern < PATTERNS; pattern++)
+  {
+    for (orMode = 0; orMode < 2; orMode++)
+    {
+      for (slow = 0; slow < 2; slow++)
+      {
+        bench_run(pattern, orMode, slow, (pattern == PATTERN_ALLTOONE) ? count / 16 : count, base,
+                  first);
+        first = 0;
+      }
+    }
+  }
+  printf("\n]\n");
+  return 0;
+}